@@ -0,0 +1,113 @@
+/* log-linear histogram in the style of HdrHistogram: values below 2^SUB_BITS are exact, every power of two above */
+/* is split into 2^(SUB_BITS - 1) buckets, so whatever is reported is within 2^(1 - SUB_BITS) of what was recorded */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+class Histogram {
+    static const int SUB_BITS = 8;
+    static const uint64_t HALF = 1 << (SUB_BITS - 1);
+    std::vector<uint64_t> counts;
+    uint64_t total = 0, minimum = UINT64_MAX, maximum = 0;
+    double sum = 0, sumSquares = 0;
+
+    static int magnitude(uint64_t value) {
+        return 63 - __builtin_clzll(value);
+    }
+
+    static size_t index(uint64_t value) {
+        if (value < 2 * HALF) {
+            return value;
+        }
+        int shift = magnitude(value) - SUB_BITS + 1;
+        return shift * HALF + (value >> shift);
+    }
+
+    // the largest value that lands in the same bucket
+    static uint64_t highest(size_t index) {
+        if (index < 2 * HALF) {
+            return index;
+        }
+        int shift = index / HALF - 1;
+        uint64_t sub = index - shift * HALF;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    Histogram() : counts((64 - SUB_BITS + 2) * HALF) {}
+
+    void record(uint64_t value, uint64_t count = 1) {
+        counts[index(value)] += count;
+        total += count;
+        sum += (double) value * count;
+        sumSquares += (double) value * value * count;
+        minimum = std::min(minimum, value);
+        maximum = std::max(maximum, value);
+    }
+
+    void merge(const Histogram &other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        sumSquares += other.sumSquares;
+        minimum = std::min(minimum, other.minimum);
+        maximum = std::max(maximum, other.maximum);
+    }
+
+    void reset() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = maximum = 0;
+        minimum = UINT64_MAX;
+        sum = sumSquares = 0;
+    }
+
+    // the value at or below which the given share (0 to 1) of all recorded values lie
+    uint64_t percentile(double share) const {
+        if (!total) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t) (share * total + 0.5)), seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            if ((seen += counts[i]) >= rank) {
+                return std::min(highest(i), maximum);
+            }
+        }
+        return maximum;
+    }
+
+    uint64_t count() const {return total;}
+    uint64_t min() const {return total ? minimum : 0;}
+    uint64_t max() const {return maximum;}
+    double mean() const {return total ? sum / total : 0;}
+    double deviation() const {return total ? std::sqrt(std::max(0.0, sumSquares / total - mean() * mean())) : 0;}
+
+    // the percentile distribution in HdrHistogram's .hgrm format, five steps for every halving of the distance to 100%
+    void printPercentiles(FILE *out, double scale = 1) const {
+        fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+        uint64_t seen = 0;
+        size_t i = 0;
+        for (double share = 0, distance = 1; total; share += distance / 10, distance /= share >= 1 - distance / 2 - 1e-12 ? 2 : 1) {
+            uint64_t rank = std::max<uint64_t>(1, (uint64_t) std::ceil(share * total));
+            for (; seen < rank; seen += counts[i++]);
+            double reached = (double) seen / total;
+            if (seen == total) {
+                fprintf(out, "%12.3f %14.12f %10llu\n", std::min(highest(i - 1), maximum) / scale, 1.0, (unsigned long long) seen);
+                break;
+            }
+            fprintf(out, "%12.3f %14.12f %10llu %14.2f\n", std::min(highest(i - 1), maximum) / scale, reached, (unsigned long long) seen, 1 / (1 - reached));
+        }
+        fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / scale, deviation() / scale);
+        fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", maximum / scale, (unsigned long long) total);
+        fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n", 64 - SUB_BITS + 2, (int) HALF);
+    }
+};
+
+#endif // HISTOGRAM_H
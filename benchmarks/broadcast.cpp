@@ -0,0 +1,350 @@
+/* fan-out of Server::broadcast at a fixed rate while a share of the receivers stopped reading and let their kernel buffers fill */
+/* every mode runs in a process of its own with the server on one thread, the fast clients (µWS client) on another and */
+/* the slow ones as raw sockets that upgrade and then never read again */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <uWS.h>
+#include "Histogram.h"
+using namespace std;
+using namespace chrono;
+
+// every block remembers whether the server thread allocated it, zlib and libuv use malloc and are not seen here
+__thread bool counting = false;
+unsigned long long allocations = 0;
+atomic<long long> liveBytes(0);
+
+void *operator new(size_t size)
+{
+    size_t *block = (size_t *) malloc(size + 16);
+    if (!block) {
+        throw bad_alloc();
+    }
+    block[0] = counting ? size + 1 : 0;
+    if (counting) {
+        allocations++;
+        liveBytes += size;
+    }
+    return block + 2;
+}
+
+void operator delete(void *p) noexcept
+{
+    if (p) {
+        size_t *block = (size_t *) p - 2;
+        if (block[0]) {
+            liveBytes -= block[0] - 1;
+        }
+        free(block);
+    }
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void *p) noexcept
+{
+    operator delete(p);
+}
+
+struct Config {
+    int clients = 1000, port = 3000;
+    double slow = 0.1, rate = 100, seconds = 10;
+    size_t size = 256, rcvbuf = 0;
+    vector<string> modes = {"plain", "deflate"};
+} config;
+
+struct Result {
+    unsigned long long broadcasts = 0, allocations = 0;
+    uint64_t cpuTime = 0;
+    long long queuedBytes = 0;
+    Histogram callTime;
+};
+
+uWS::Server *server;
+string payload;
+atomic<int> connected(0), errors(0);
+atomic<bool> listening(false), measuring(false), finished(false);
+atomic<unsigned long long> delivered(0);
+Result result;
+Histogram latency;
+
+uint64_t now()
+{
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t threadCpu()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// broadcasts catch up with the rate every millisecond, the send timestamp goes in the first 8 bytes
+void onTick(uv_timer_t *t)
+{
+    static uint64_t start, cpuStart;
+    static long long liveStart;
+    if (!measuring) {
+        return;
+    }
+
+    uint64_t time = now();
+    if (!start) {
+        start = time;
+        cpuStart = threadCpu();
+        liveStart = liveBytes;
+        allocations = 0;
+    }
+
+    for (unsigned long long owed = (time - start) * 1e-9 * config.rate; result.broadcasts < owed; result.broadcasts++) {
+        uint64_t timestamp = now();
+        memcpy((char *) payload.data(), &timestamp, sizeof(timestamp));
+        server->broadcast((char *) payload.data(), payload.length(), uWS::BINARY);
+        result.callTime.record(now() - timestamp);
+    }
+
+    if ((time - start) * 1e-9 >= config.seconds) {
+        uv_timer_stop(t);
+        result.cpuTime = threadCpu() - cpuStart;
+        result.queuedBytes = liveBytes - liveStart;
+        result.allocations = allocations;
+        measuring = false;
+        finished = true;
+    }
+}
+
+void runServer(bool deflate)
+{
+    counting = true;
+    uWS::EventSystem es(uWS::MASTER);
+    try {
+        // without server_no_context_takeover every socket keeps its own stream and gets the uncompressed frame
+        server = new uWS::Server(es, config.port, deflate ? uWS::PERMESSAGE_DEFLATE | uWS::SERVER_NO_CONTEXT_TAKEOVER : uWS::NO_OPTIONS, 0);
+    } catch (...) {
+        cout << "ERR_LISTEN" << endl;
+        exit(-1);
+    }
+    server->onConnection([](uWS::WebSocket socket) {
+        connected++;
+    });
+
+    // a master loop runs on the default libuv loop
+    uv_timer_t timer;
+    uv_timer_init(uv_default_loop(), &timer);
+    uv_timer_start(&timer, onTick, 1, 1);
+    listening = true;
+    es.run();
+}
+
+// a few connections in flight at a time keep within the listen backlog
+void runFastClients(int count, bool deflate)
+{
+    uWS::EventSystem es(uWS::WORKER);
+    uWS::Server group(es, 0, deflate ? uWS::PERMESSAGE_DEFLATE : uWS::NO_OPTIONS, 0);
+    string url = "ws://localhost:" + to_string(config.port);
+    int opened = 0;
+
+    auto connectNext = [&es, &group, &url, &opened, count]() {
+        if (opened < count) {
+            opened++;
+            es.connect(url, &group);
+        }
+    };
+
+    group.onConnection([connectNext](uWS::WebSocket socket) {
+        connectNext();
+    });
+
+    group.onConnectionError([connectNext](void *user) {
+        errors++;
+        connectNext();
+    });
+
+    group.onMessage([](uWS::WebSocket socket, char *message, size_t length, uWS::OpCode opCode) {
+        if (length >= sizeof(uint64_t)) {
+            uint64_t timestamp;
+            memcpy(&timestamp, message, sizeof(timestamp));
+            latency.record((now() - timestamp) / 1000);
+            delivered++;
+        }
+    });
+
+    for (int i = 0; i < 8; i++) {
+        connectNext();
+    }
+    es.run();
+}
+
+// blocking upgrade, after which the socket is never read from
+int connectSlowClient(bool deflate)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (config.rcvbuf) {
+        int rcvbuf = config.rcvbuf;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(fd, (sockaddr *) &addr, sizeof(addr))) {
+        return -1;
+    }
+
+    string request = "GET / HTTP/1.1\r\n"
+                     "Host: localhost\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                     "Sec-WebSocket-Version: 13\r\n";
+    if (deflate) {
+        request += "Sec-WebSocket-Extensions: permessage-deflate\r\n";
+    }
+    request += "\r\n";
+    if (send(fd, request.data(), request.length(), 0) != (ssize_t) request.length()) {
+        return -1;
+    }
+
+    string response;
+    char buffer[1024];
+    while (response.find("\r\n\r\n") == string::npos) {
+        ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+        if (length <= 0) {
+            return -1;
+        }
+        response.append(buffer, length);
+    }
+    return fd;
+}
+
+void run(string mode)
+{
+    bool deflate = mode == "deflate";
+    int slow = config.clients * config.slow + 0.5, fast = config.clients - slow;
+
+    // compressible enough for permessage-deflate to matter
+    payload.resize(max(config.size, sizeof(uint64_t)));
+    for (size_t i = 0; i < payload.length(); i++) {
+        payload[i] = "etaoin shrdlu"[rand() % 13];
+    }
+
+    thread([deflate] {
+        runServer(deflate);
+    }).detach();
+    while (!listening) {
+        this_thread::sleep_for(milliseconds(10));
+    }
+
+    vector<int> slowSockets;
+    for (int i = 0; i < slow; i++) {
+        int fd = connectSlowClient(deflate);
+        if (fd == -1) {
+            cout << "Could not connect slow client " << i << endl;
+            exit(-1);
+        }
+        slowSockets.push_back(fd);
+    }
+
+    thread([fast, deflate] {
+        runFastClients(fast, deflate);
+    }).detach();
+
+    while (connected + errors < config.clients) {
+        this_thread::sleep_for(milliseconds(10));
+    }
+    if (errors) {
+        cout << errors << " clients failed to connect" << endl;
+        exit(-1);
+    }
+
+    measuring = true;
+    while (!finished) {
+        this_thread::sleep_for(milliseconds(10));
+    }
+    // the last broadcasts are still on their way to the fast clients
+    this_thread::sleep_for(milliseconds(500));
+
+    // microseconds, queued bytes is what the server thread allocated during the run and still holds
+    unsigned long long broadcasts = max(result.broadcasts, 1ull);
+    printf("%-8s %8d %6d %10llu %12.2f %10.1f %10.1f %10.1f %10.1f %10.1f %10.2f %12.2f %10.2f %12.1f\n", mode.c_str(), config.clients, slow,
+           result.broadcasts, result.cpuTime / 1e3 / broadcasts, result.callTime.percentile(0.5) / 1e3, result.callTime.percentile(0.99) / 1e3,
+           (double) latency.percentile(0.5), (double) latency.percentile(0.99), (double) latency.max(),
+           fast ? 100.0 * delivered / ((double) result.broadcasts * fast) : 0, (double) result.allocations / broadcasts,
+           result.queuedBytes / 1e6, slow ? result.queuedBytes / 1e3 / slow : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i], key = argument.substr(0, argument.find('=')), value = argument.substr(argument.find('=') + 1);
+        if (key == "clients") {
+            config.clients = max(1, atoi(value.c_str()));
+        } else if (key == "slow") {
+            config.slow = min(1.0, max(0.0, atof(value.c_str())));
+        } else if (key == "rate") {
+            config.rate = atof(value.c_str());
+        } else if (key == "seconds") {
+            config.seconds = atof(value.c_str());
+        } else if (key == "size") {
+            config.size = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "rcvbuf") {
+            config.rcvbuf = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "port") {
+            config.port = atoi(value.c_str());
+        } else if (key == "modes") {
+            config.modes.clear();
+            stringstream stream(value);
+            for (string mode; getline(stream, mode, ',');) {
+                if (mode != "plain" && mode != "deflate") {
+                    cout << "Unknown mode " << mode << endl;
+                    return -1;
+                }
+                config.modes.push_back(mode);
+            }
+        } else {
+            cout << "Usage: broadcast [clients=1000] [slow=0.1] [rate=100] [seconds=10] [size=256] [rcvbuf=0] [modes=plain,deflate] [port=3000]" << endl;
+            return -1;
+        }
+    }
+
+    printf("%-8s %8s %6s %10s %12s %10s %10s %10s %10s %10s %10s %12s %10s %12s\n", "mode", "clients", "slow", "broadcasts", "cpu/bcast",
+           "call p50", "call p99", "lat p50", "lat p99", "lat max", "delivered%", "allocs/bcast", "queued MB", "KB/slow");
+    fflush(stdout);
+
+    // a fresh process for every mode, the event loops never return and nothing carries over
+    for (size_t i = 0; i < config.modes.size(); i++) {
+        pid_t pid = fork();
+        if (!pid) {
+            srand(1);
+            config.port += i;
+            run(config.modes[i]);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <cctype>
+#include <cstring>
+#include <cstdlib>
+#include "HTTPParser.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const char request[] = "GET /chat?room=42 HTTP/1.1\r\n"
+                       "Host: server.example.com:3000\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Pragma: no-cache\r\n"
+                       "Cache-Control: no-cache\r\n"
+                       "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/53.0.2785.116 Safari/537.36\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Origin: http://server.example.com\r\n"
+                       "Sec-WebSocket-Version: 13\r\n"
+                       "Accept-Encoding: gzip, deflate, sdch\r\n"
+                       "Accept-Language: en-US,en;q=0.8,sv;q=0.6\r\n"
+                       "Cookie: session=8f2b1c9e0d3a4b5c6d7e8f9a0b1c2d3e; theme=dark; locale=en\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                       "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+                       "\r\n";
+
+volatile size_t sink;
+
+// what HTTPSocket did before: rescan the whole buffer per read, lowercase and compare in place
+size_t previous(const char *data, size_t length, size_t chunk)
+{
+    string headerBuffer;
+    size_t found = 0;
+    for (size_t offset = 0; offset < length; offset += chunk) {
+        headerBuffer.append(data + offset, min(chunk, length - offset));
+        if (headerBuffer.find("\r\n\r\n") != string::npos) {
+            char *cursor = (char *) strchr(headerBuffer.data(), '\n') + 1;
+            while (!(cursor[0] == '\r' && cursor[1] == '\n')) {
+                char *key = cursor;
+                size_t keyLength = 0;
+                for (; cursor[keyLength] != ':' && cursor[keyLength] != '\r'; keyLength++);
+                cursor += keyLength;
+                while (isspace(*(++cursor)));
+                char *value = cursor;
+                for (; *cursor != '\r'; cursor++);
+                cursor += 2;
+                if (keyLength == 17 || keyLength == 24) {
+                    for (size_t i = 0; i < keyLength; i++) {
+                        key[i] = tolower(key[i]);
+                    }
+                    if (!strncmp(key, "sec-websocket-key", keyLength) || !strncmp(key, "sec-websocket-extensions", keyLength)) {
+                        found += value[0];
+                    }
+                }
+            }
+            break;
+        }
+    }
+    return found;
+}
+
+size_t current(const char *data, size_t length, size_t chunk)
+{
+    uWS::HTTPParser parser;
+    uWS::Header headers[uWS::HTTPParser::MAX_HEADERS];
+    size_t found = 0;
+    for (size_t offset = 0; offset < length; offset += chunk) {
+        if (size_t headLength = parser.consume(data, min(offset + chunk, length))) {
+            unsigned int headerCount = uWS::HTTPParser::parseHeaders((char *) data, headLength, headers);
+            for (unsigned int i = 0; i < headerCount; i++) {
+                if (headers[i].is("sec-websocket-key", 17) || headers[i].is("sec-websocket-extensions", 24)) {
+                    found += headers[i].value[0];
+                }
+            }
+            break;
+        }
+    }
+    return found;
+}
+
+template <class F>
+void measure(const char *name, F f, size_t chunk, int iterations)
+{
+    string copy(request, sizeof(request) - 1);
+    auto start = high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        sink = f(&copy[0], copy.length(), chunk);
+    }
+    double ns = duration_cast<nanoseconds>(high_resolution_clock::now() - start).count() / (double) iterations;
+    cout << name << " (" << chunk << " byte reads): " << ns << " ns/handshake, " << (1e9 / ns) << " handshakes/s" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    cout << "Request head: " << sizeof(request) - 1 << " bytes" << endl;
+    for (size_t chunk : {sizeof(request), (size_t) 64, (size_t) 1}) {
+        int scaled = chunk == 1 ? iterations / 20 : iterations;
+        measure("Previous", previous, chunk, scaled);
+        measure("Current ", current, chunk, scaled);
+    }
+}
@@ -0,0 +1,266 @@
+/* round trip latency of the echo example, as a histogram for every connection count and message size */
+/* the servers run in-process with the handlers of examples/echo.cpp: plain, spread over threads, over TLS and with permessage-deflate */
+/* the ssl mode needs cert.pem and key.pem for localhost in the working directory, a self-signed pair is fine */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <uWS.h>
+#include "Histogram.h"
+using namespace std;
+using namespace chrono;
+
+const int THREADS = 4;
+
+struct Cell {
+    string mode;
+    int connections;
+    size_t size;
+    Histogram latency;
+};
+
+vector<Cell> cells;
+size_t current = 0;
+int connected = 0;
+unsigned long long sent = 0, received = 0, messagesPerCell = 10000;
+string payload;
+atomic<bool> finished(false);
+
+uint64_t now()
+{
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+vector<size_t> parseList(string value)
+{
+    vector<size_t> list;
+    stringstream stream(value);
+    for (string item; getline(stream, item, ',');) {
+        list.push_back(strtoull(item.c_str(), nullptr, 10));
+    }
+    return list;
+}
+
+void echo(uWS::Server &server)
+{
+    server.onMessage([](uWS::WebSocket socket, char *message, size_t length, uWS::OpCode opCode) {
+        socket.send(message, length, opCode);
+    });
+}
+
+// the servers of every mode, one port each starting at port
+void startServers(int port, vector<string> modes)
+{
+    atomic<bool> listening(false);
+    thread([port, modes, &listening] {
+        try {
+            uWS::EventSystem es(uWS::MASTER);
+            vector<uWS::Server *> servers;
+            for (size_t i = 0; i < modes.size(); i++) {
+                if (modes[i] == "plain" || modes[i] == "threads") {
+                    servers.push_back(new uWS::Server(es, port + i, uWS::NO_OPTIONS, 0));
+                } else if (modes[i] == "deflate") {
+                    servers.push_back(new uWS::Server(es, port + i, uWS::PERMESSAGE_DEFLATE, 0));
+                } else if (modes[i] == "ssl") {
+                    servers.push_back(new uWS::Server(es, port + i, uWS::NO_OPTIONS, 0, uWS::SSLContext("cert.pem", "key.pem")));
+                } else {
+                    cout << "Unknown mode " << modes[i] << endl;
+                    exit(-1);
+                }
+                echo(*servers.back());
+
+                // like examples/multithreaded_echo.cpp, the listening loop only accepts
+                if (modes[i] == "threads") {
+                    uWS::Server **threaded = new uWS::Server *[THREADS];
+                    atomic<int> ready(0);
+                    for (int j = 0; j < THREADS; j++) {
+                        thread([j, threaded, &ready] {
+                            uWS::EventSystem tes(uWS::WORKER);
+                            threaded[j] = new uWS::Server(tes, 0, uWS::NO_OPTIONS, 0);
+                            echo(*threaded[j]);
+                            ready++;
+                            tes.run();
+                        }).detach();
+                    }
+                    while (ready < THREADS) {
+                        this_thread::sleep_for(milliseconds(1));
+                    }
+                    servers.back()->onAccept([threaded](uv_os_sock_t fd, void *ssl) {
+                        static int next = 0;
+                        threaded[next++ % THREADS]->adopt(fd, ssl);
+                    });
+                }
+            }
+            listening = true;
+            es.run();
+        } catch (...) {
+            cout << "ERR_LISTEN or ERR_SSL (is there a cert.pem and key.pem?)" << endl;
+            exit(-1);
+        }
+    }).detach();
+
+    while (!listening) {
+        this_thread::sleep_for(milliseconds(10));
+    }
+}
+
+void sendOne(uWS::WebSocket socket)
+{
+    uint64_t timestamp = now();
+    memcpy((char *) payload.data(), &timestamp, sizeof(timestamp));
+    socket.send(payload.data(), cells[current].size, uWS::BINARY);
+    sent++;
+}
+
+// cells run one after the other, each with freshly connected sockets that keep one message in flight
+void connectCell(uWS::EventSystem &es, uWS::Server &clients, vector<string> &urls, vector<string> &modes)
+{
+    if (current == cells.size()) {
+        finished = true;
+        return;
+    }
+    connected = 0;
+    sent = received = 0;
+    for (size_t i = 0; i < modes.size(); i++) {
+        if (modes[i] == cells[current].mode) {
+            for (int j = 0; j < cells[current].connections; j++) {
+                es.connect(urls[i], &clients);
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    vector<string> modes = {"plain", "threads", "ssl", "deflate"};
+    vector<size_t> connections = {1, 10, 100, 1000}, sizes = {16, 512, 16384};
+    vector<string> urls;
+    int port = 3000;
+    bool hgrm = false;
+
+    for (int i = 1; i < argc; i++) {
+        string argument = argv[i], key = argument.substr(0, argument.find('=')), value = argument.substr(argument.find('=') + 1);
+        if (key == "modes") {
+            modes.clear();
+            stringstream stream(value);
+            for (string mode; getline(stream, mode, ',');) {
+                modes.push_back(mode);
+            }
+        } else if (key == "connections") {
+            connections = parseList(value);
+        } else if (key == "sizes") {
+            sizes = parseList(value);
+        } else if (key == "messages") {
+            messagesPerCell = strtoull(value.c_str(), nullptr, 10);
+        } else if (key == "port") {
+            port = atoi(value.c_str());
+        } else if (key == "url") {
+            modes = {"external"};
+            urls = {value};
+        } else if (key == "hgrm") {
+            hgrm = value == "1";
+        } else {
+            cout << "Usage: latency [modes=plain,threads,ssl,deflate] [connections=1,10,100,1000] [sizes=16,512,16384] [messages=10000] [port=3000] [url=ws://...] [hgrm=0]" << endl;
+            return -1;
+        }
+    }
+
+    if (urls.empty()) {
+        startServers(port, modes);
+        for (size_t i = 0; i < modes.size(); i++) {
+            urls.push_back((modes[i] == "ssl" ? "wss://localhost:" : "ws://localhost:") + to_string(port + i));
+        }
+        // our own certificate is the one to trust
+        setenv("SSL_CERT_FILE", "cert.pem", 0);
+    }
+
+    size_t largest = sizeof(uint64_t);
+    for (string &mode : modes) {
+        for (size_t count : connections) {
+            for (size_t &size : sizes) {
+                size = max(size, sizeof(uint64_t));
+                largest = max(largest, size);
+                cells.push_back({mode, (int) count, size, Histogram()});
+            }
+        }
+    }
+
+    // compressible enough for permessage-deflate to be worth it
+    payload.resize(largest);
+    for (size_t i = 0; i < largest; i++) {
+        payload[i] = "etaoin shrdlu"[rand() % 13];
+    }
+
+    thread([&] {
+        uWS::EventSystem es(uWS::WORKER);
+        uWS::Server clients(es, 0, uWS::PERMESSAGE_DEFLATE, 0);
+
+        clients.onConnection([&](uWS::WebSocket socket) {
+            if (++connected == cells[current].connections) {
+                for (uWS::WebSocket webSocket : clients) {
+                    sendOne(webSocket);
+                }
+            }
+        });
+
+        clients.onMessage([&](uWS::WebSocket socket, char *message, size_t length, uWS::OpCode opCode) {
+            uint64_t timestamp;
+            memcpy(&timestamp, message, sizeof(timestamp));
+            cells[current].latency.record(now() - timestamp);
+
+            if (++received == messagesPerCell) {
+                // closing unlinks, so the list is copied first
+                vector<uWS::WebSocket> sockets;
+                for (uWS::WebSocket webSocket : clients) {
+                    sockets.push_back(webSocket);
+                }
+                for (uWS::WebSocket webSocket : sockets) {
+                    webSocket.close();
+                }
+            } else if (sent < messagesPerCell) {
+                sendOne(socket);
+            }
+        });
+
+        clients.onDisconnection([&](uWS::WebSocket socket, int code, char *message, size_t length) {
+            if (!--connected) {
+                current++;
+                connectCell(es, clients, urls, modes);
+            }
+        });
+
+        clients.onConnectionError([](void *user) {
+            cout << "Connection error" << endl;
+            exit(-1);
+        });
+
+        connectCell(es, clients, urls, modes);
+        es.run();
+    }).detach();
+
+    while (!finished) {
+        this_thread::sleep_for(milliseconds(10));
+    }
+
+    // microseconds
+    printf("%-9s %11s %8s %10s %10s %10s %10s %10s %10s %10s\n", "mode", "connections", "size", "messages", "p50", "p90", "p99", "p999", "p9999", "max");
+    for (Cell &cell : cells) {
+        Histogram &h = cell.latency;
+        printf("%-9s %11d %8zu %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", cell.mode.c_str(), cell.connections, cell.size, (unsigned long long) h.count(),
+               h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.percentile(0.9999) / 1e3, h.max() / 1e3);
+
+        if (hgrm) {
+            string name = "latency_" + cell.mode + "_" + to_string(cell.connections) + "_" + to_string(cell.size) + ".hgrm";
+            FILE *file = fopen(name.c_str(), "w");
+            h.printPercentiles(file, 1e3);
+            fclose(file);
+        }
+    }
+    return 0;
+}
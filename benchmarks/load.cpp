@@ -0,0 +1,269 @@
+/* multi-threaded load generator on the library's own client: every thread runs an event loop with its share of the */
+/* connections, each keeping depth timestamped messages in flight against an echo server, results are printed as JSON */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <uWS.h>
+#include "Histogram.h"
+using namespace std;
+using namespace chrono;
+
+struct Config {
+    string url = "ws://localhost:3000";
+    int threads = 1, connections = 100, depth = 1, steps = 1;
+    double seconds = 10, ramp = 0;
+    vector<size_t> sizes = {64};
+    bool range = false, deflate = false, text = false;
+} config;
+
+struct Step {
+    Histogram latency;
+    unsigned long long messages = 0, bytes = 0;
+};
+
+struct Worker {
+    int connections;
+    int opened = 0;
+    atomic<int> errors, closed;
+    atomic<bool> done;
+    vector<Step> steps;
+    mt19937 random;
+    string payload;
+    Worker() : errors(0), closed(0), done(false) {}
+};
+
+uint64_t start;
+
+uint64_t now()
+{
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// -1 while ramping up and once the run is over
+int stepAt(uint64_t time)
+{
+    double elapsed = (time - start) * 1e-9 - config.ramp;
+    if (elapsed < 0 || elapsed >= config.seconds) {
+        return -1;
+    }
+    return elapsed * config.steps / config.seconds;
+}
+
+// the first step is reached linearly over the ramp, every further step adds an equal share at once
+int connectionsAt(Worker &worker, uint64_t time)
+{
+    double elapsed = (time - start) * 1e-9;
+    int first = max(1, worker.connections / config.steps);
+    if (elapsed < config.ramp) {
+        return max(1, (int) (first * elapsed / config.ramp));
+    }
+    int step = min<int>(config.steps - 1, (elapsed - config.ramp) * config.steps / config.seconds);
+    return step == config.steps - 1 ? worker.connections : first * (step + 1);
+}
+
+size_t nextSize(Worker &worker)
+{
+    if (config.range) {
+        return uniform_int_distribution<size_t>(config.sizes[0], config.sizes[1])(worker.random);
+    }
+    return config.sizes[uniform_int_distribution<size_t>(0, config.sizes.size() - 1)(worker.random)];
+}
+
+// the send timestamp goes in the first 8 bytes, the echo brings it back
+void sendOne(Worker &worker, uWS::WebSocket socket)
+{
+    char *payload = (char *) worker.payload.data();
+    uint64_t timestamp = now();
+    memcpy(payload, &timestamp, sizeof(timestamp));
+    socket.send(payload, nextSize(worker), config.text ? uWS::TEXT : uWS::BINARY);
+}
+
+void run(Worker &worker)
+{
+    uWS::EventSystem es(uWS::WORKER);
+    uWS::Server group(es, 0, config.deflate ? uWS::PERMESSAGE_DEFLATE : uWS::NO_OPTIONS, 0);
+
+    // with nothing open no event would come to open the rest, so the next connection goes out early
+    auto rampUp = [&worker, &es, &group](uint64_t time) {
+        int target = connectionsAt(worker, time);
+        if (worker.opened == worker.closed) {
+            target = max(target, min(worker.opened + 1, worker.connections));
+        }
+        for (; worker.opened < target; worker.opened++) {
+            es.connect(config.url, &group);
+        }
+    };
+
+    // every connection of the worker has to have been opened and closed, the steps are not touched after this
+    auto closed = [&worker, rampUp]() {
+        if (++worker.closed == worker.connections) {
+            worker.done = true;
+        } else {
+            rampUp(now());
+        }
+    };
+
+    group.onConnection([&worker, rampUp](uWS::WebSocket socket) {
+        for (int i = 0; i < config.depth; i++) {
+            sendOne(worker, socket);
+        }
+        rampUp(now());
+    });
+
+    group.onMessage([&worker, rampUp](uWS::WebSocket socket, char *message, size_t length, uWS::OpCode opCode) {
+        uint64_t time = now();
+        int step = stepAt(time);
+        if (step >= 0 && length >= sizeof(uint64_t)) {
+            uint64_t timestamp;
+            memcpy(&timestamp, message, sizeof(timestamp));
+            worker.steps[step].latency.record((time - timestamp) / 1000);
+            worker.steps[step].messages++;
+            worker.steps[step].bytes += length;
+        }
+
+        if ((time - start) * 1e-9 >= config.ramp + config.seconds) {
+            socket.close();
+            return;
+        }
+        rampUp(time);
+        sendOne(worker, socket);
+    });
+
+    group.onDisconnection([closed](uWS::WebSocket socket, int code, char *message, size_t length) {
+        closed();
+    });
+
+    group.onConnectionError([&worker, closed](void *user) {
+        worker.errors++;
+        closed();
+    });
+
+    rampUp(now());
+    es.run();
+}
+
+bool parse(const string &argument)
+{
+    size_t equals = argument.find('=');
+    if (equals == string::npos) {
+        return false;
+    }
+    string key = argument.substr(0, equals), value = argument.substr(equals + 1);
+    if (key == "url") {
+        config.url = value;
+    } else if (key == "threads") {
+        config.threads = max(1, atoi(value.c_str()));
+    } else if (key == "connections") {
+        config.connections = max(1, atoi(value.c_str()));
+    } else if (key == "depth") {
+        config.depth = max(1, atoi(value.c_str()));
+    } else if (key == "seconds") {
+        config.seconds = atof(value.c_str());
+    } else if (key == "ramp") {
+        config.ramp = atof(value.c_str());
+    } else if (key == "steps") {
+        config.steps = max(1, atoi(value.c_str()));
+    } else if (key == "deflate") {
+        config.deflate = value == "1";
+    } else if (key == "text") {
+        config.text = value == "1";
+    } else if (key == "size") {
+        // 64 fixed, 16-4096 uniform or 16,256,4096 picked from
+        config.sizes.clear();
+        config.range = value.find('-') != string::npos;
+        stringstream list(value);
+        for (string size; getline(list, size, config.range ? '-' : ',');) {
+            config.sizes.push_back(max<size_t>(sizeof(uint64_t), strtoull(size.c_str(), nullptr, 10)));
+        }
+        if (config.sizes.empty() || (config.range && (config.sizes.size() != 2 || config.sizes[0] > config.sizes[1]))) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (!parse(argv[i])) {
+            cout << "Usage: load [url=ws://localhost:3000] [threads=1] [connections=100] [depth=1] [size=64|16-4096|16,256,4096]"
+                    " [deflate=0] [text=0] [seconds=10] [ramp=0] [steps=1]" << endl;
+            return -1;
+        }
+    }
+    config.threads = min(config.threads, config.connections);
+
+    // text payloads are compressible, binary ones are not
+    string payload(*max_element(config.sizes.begin(), config.sizes.end()), 0);
+    mt19937 random(1);
+    for (char &c : payload) {
+        c = config.text ? "etaoin shrdlu"[random() % 13] : (char) random();
+    }
+
+    vector<Worker> workers(config.threads);
+    start = now();
+    for (int i = 0; i < config.threads; i++) {
+        Worker &worker = workers[i];
+        worker.connections = config.connections / config.threads + (i < config.connections % config.threads);
+        worker.steps.resize(config.steps);
+        worker.random.seed(i);
+        worker.payload = payload;
+        thread([&worker] {
+            run(worker);
+        }).detach();
+    }
+
+    // worker loops never return, only those done within a grace second are read and the rest are left out of the results
+    uint64_t deadline = start + (uint64_t) ((config.ramp + config.seconds + 1) * 1e9);
+    for (bool done = false; !done && now() < deadline; this_thread::sleep_for(milliseconds(10))) {
+        done = true;
+        for (Worker &worker : workers) {
+            done = done && worker.done;
+        }
+    }
+
+    int errors = 0, unfinished = 0;
+    vector<Worker *> finished;
+    for (Worker &worker : workers) {
+        errors += worker.errors;
+        if (worker.done) {
+            finished.push_back(&worker);
+        } else {
+            unfinished++;
+        }
+    }
+
+    cout << "{\"url\": \"" << config.url << "\", \"threads\": " << config.threads << ", \"connections\": " << config.connections
+         << ", \"depth\": " << config.depth << ", \"deflate\": " << (config.deflate ? "true" : "false") << ", \"text\": " << (config.text ? "true" : "false")
+         << ", \"ramp\": " << config.ramp << ", \"errors\": " << errors << ", \"unfinishedThreads\": " << unfinished << ", \"steps\": [";
+
+    double stepSeconds = config.seconds / config.steps;
+    for (int i = 0; i < config.steps; i++) {
+        Step total;
+        int connections = 0;
+        for (Worker *worker : finished) {
+            total.latency.merge(worker->steps[i].latency);
+            total.messages += worker->steps[i].messages;
+            total.bytes += worker->steps[i].bytes;
+            connections += i == config.steps - 1 ? worker->connections : max(1, worker->connections / config.steps) * (i + 1);
+        }
+        cout << (i ? ", " : "") << "{\"connections\": " << connections << ", \"seconds\": " << stepSeconds
+             << ", \"messages\": " << total.messages << ", \"messagesPerSecond\": " << total.messages / stepSeconds
+             << ", \"megabytesPerSecond\": " << total.bytes / stepSeconds / 1e6
+             << ", \"latencyMicroseconds\": {\"mean\": " << total.latency.mean() << ", \"p50\": " << total.latency.percentile(0.5)
+             << ", \"p99\": " << total.latency.percentile(0.99) << ", \"p999\": " << total.latency.percentile(0.999)
+             << ", \"max\": " << total.latency.max() << "}}";
+    }
+    cout << "]}" << endl;
+    return 0;
+}
@@ -0,0 +1,231 @@
+/* microbenchmarks of the hot paths behind a socket, fed from memory so that nothing but the code itself is measured */
+/* every input is generated from fixed seeds and every case reports the best of its repetitions, so runs compare between commits */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <openssl/sha.h>
+#include <uWS.h>
+#include "Extensions.h"
+#include "SocketData.h"
+#include "Parser.h"
+#include "UTF8.h"
+using namespace std;
+using namespace chrono;
+
+void base64(const unsigned char *src, size_t length, char *dst);
+
+const char *filter = nullptr;
+int repetitions = 5;
+volatile size_t sink;
+
+// sizes the batch to about 20 ms and keeps the fastest of all repetitions
+template <class F>
+void measure(string name, size_t bytesPerOp, F f)
+{
+    if (filter && name.find(filter) == string::npos) {
+        return;
+    }
+
+    auto run = [&f](size_t ops) {
+        auto start = high_resolution_clock::now();
+        for (size_t i = 0; i < ops; i++) {
+            f();
+        }
+        return duration_cast<nanoseconds>(high_resolution_clock::now() - start).count() / (double) ops;
+    };
+
+    size_t ops = 1;
+    for (double ns; (ns = run(ops)) * ops < 2e7; ops = max<size_t>(ops * 2, 2e7 / max(ns, 1.0)));
+    double best = run(ops);
+    for (int i = 1; i < repetitions; i++) {
+        best = min(best, run(ops));
+    }
+
+    printf("%-44s %12.1f ns/op", name.c_str(), best);
+    if (bytesPerOp) {
+        printf(" %10.1f MB/s", bytesPerOp / best * 1e3);
+    }
+    printf("\n");
+}
+
+// pseudo text made of common words, about as compressible as chat messages
+string text(size_t length, mt19937 &random)
+{
+    static const char *words[] = {"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "price", "update", "order", "book",
+                                  "bid", "ask", "user", "joined", "channel", "message", "hello", "world", "\"id\":", "{", "}", "42"};
+    string result;
+    while (result.length() < length) {
+        result += words[random() % (sizeof(words) / sizeof(*words))];
+        result += ' ';
+    }
+    result.resize(length);
+    return result;
+}
+
+// messages of the given sizes, each split into fragments frames, masked like a client sends them or not like a server does
+string frameStream(vector<size_t> sizes, int fragments, bool masked, mt19937 &random)
+{
+    string stream;
+    vector<char> frame;
+    for (size_t size : sizes) {
+        string payload = text(size, random);
+        size_t offset = 0;
+        for (int i = 0; i < fragments; i++) {
+            size_t length = i == fragments - 1 ? size - offset : size / fragments;
+            int flags = (masked ? uWS::SND_MASKED : 0) | (i ? uWS::SND_CONTINUATION : 0) | (i < fragments - 1 ? uWS::SND_NO_FIN : 0);
+            frame.resize(length + 14);
+            stream.append(frame.data(), uWS::formatMessage(frame.data(), payload.data() + offset, length, uWS::BINARY, length, false, flags));
+            offset += length;
+        }
+    }
+    return stream;
+}
+
+vector<size_t> uniform(size_t count, size_t min, size_t max, mt19937 &random)
+{
+    vector<size_t> sizes;
+    for (size_t i = 0; i < count; i++) {
+        sizes.push_back(uniform_int_distribution<size_t>(min, max)(random));
+    }
+    return sizes;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    if (argc > 2) {
+        repetitions = max(1, atoi(argv[2]));
+    }
+
+    uWS::EventSystem es(uWS::MASTER);
+    uWS::Server server(es, 0, uWS::NO_OPTIONS, 0);
+    size_t delivered = 0;
+    server.onMessage([&delivered](uWS::WebSocket socket, char *message, size_t length, uWS::OpCode opCode) {
+        delivered += length;
+    });
+
+    // Parser::consume the way onReadable calls it: spill and the next read copied into the receive buffer
+    mt19937 random(1);
+    struct Stream {
+        string name;
+        vector<size_t> sizes;
+        int fragments;
+    } streams[] = {
+        {"small", uniform(2000, 2, 125, random), 1},
+        {"medium", uniform(200, 126, 4096, random), 1},
+        {"large", vector<size_t>(4, 70000), 1},
+        {"fragmented", uniform(200, 512, 2048, random), 4}
+    };
+
+    static const size_t BUFFER_SIZE = 307200;
+    vector<char> buffer(BUFFER_SIZE + uWS::Parser::CONSUME_POST_PADDING);
+    uv_poll_t p = {};
+    for (bool masked : {true, false}) {
+        for (Stream &stream : streams) {
+            string frames = frameStream(stream.sizes, stream.fragments, masked, random);
+
+            // reads of a fixed size cut frames at regular places, random ones everywhere
+            vector<pair<string, vector<size_t>>> readPatterns = {{"64", {64}}, {"1500", {1500}}, {"16384", {16384}}, {"random", uniform(1024, 1, 8192, random)}};
+            for (auto &readPattern : readPatterns) {
+                uWS::SocketData socketData;
+                socketData.server = &server;
+                p.data = &socketData;
+                measure(string("consume ") + (masked ? "server " : "client ") + stream.name + " reads " + readPattern.first, frames.length(), [&]() {
+                    size_t r = 0;
+                    for (size_t offset = 0; offset < frames.length(); r++) {
+                        size_t length = min(readPattern.second[r % readPattern.second.size()], frames.length() - offset);
+                        memcpy(buffer.data(), socketData.spill, socketData.spillLength);
+                        memcpy(buffer.data() + socketData.spillLength, frames.data() + offset, length);
+                        if (masked) {
+                            uWS::Parser::consume(socketData.spillLength + length, buffer.data(), &socketData, &p);
+                        } else {
+                            uWS::Parser::consume<false>(socketData.spillLength + length, buffer.data(), &socketData, &p);
+                        }
+                        offset += length;
+                    }
+                });
+            }
+        }
+    }
+    sink = delivered;
+
+    for (size_t size : {16, 125, 1024, 65536}) {
+        string payload = text(size, random);
+        vector<char> frame(size + 14);
+        for (bool masked : {false, true}) {
+            measure("formatMessage " + string(masked ? "masked " : "") + to_string(size), size, [&]() {
+                sink = uWS::formatMessage(frame.data(), payload.data(), size, uWS::TEXT, size, false, masked ? uWS::SND_MASKED : 0);
+            });
+        }
+    }
+
+    for (size_t size : {64, 16384}) {
+        string ascii = text(size, random), mixed;
+        while (mixed.length() < size) {
+            mixed += "smörgåsbord – 日本語のテキスト 🙂 ";
+        }
+        mixed.resize(size);
+        while (!uWS::isValidUtf8((unsigned char *) mixed.data(), mixed.length())) {
+            mixed.pop_back();
+        }
+        measure("isValidUtf8 ascii " + to_string(size), ascii.length(), [&]() {
+            sink = uWS::isValidUtf8((unsigned char *) ascii.data(), ascii.length());
+        });
+        measure("isValidUtf8 multibyte " + to_string(size), mixed.length(), [&]() {
+            sink = uWS::isValidUtf8((unsigned char *) mixed.data(), mixed.length());
+        });
+    }
+
+    const char *offers[][2] = {
+        {"plain", "permessage-deflate"},
+        {"chrome", "permessage-deflate; client_max_window_bits"},
+        {"parameters", "permessage-deflate; server_no_context_takeover; client_no_context_takeover; server_max_window_bits=10; client_max_window_bits=10"},
+        {"fallbacks", "x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=12, permessage-deflate"}
+    };
+    for (auto &offer : offers) {
+        measure(string("ExtensionsParser ") + offer[0], strlen(offer[1]), [&]() {
+            ExtensionsParser extensionsParser(offer[1]);
+            sink = extensionsParser.acceptable();
+        });
+    }
+
+    // Sec-WebSocket-Accept as the upgrade response is built
+    measure("upgrade accept SHA1 + base64", 0, [&]() {
+        unsigned char shaInput[] = "dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+        unsigned char shaDigest[SHA_DIGEST_LENGTH];
+        SHA1(shaInput, sizeof(shaInput) - 1, shaDigest);
+        char accept[28];
+        base64(shaDigest, SHA_DIGEST_LENGTH, accept);
+        sink = accept[0];
+    });
+
+    // whole messages without context takeover, every one through a read stream from the pool
+    ZlibPool zlibPool;
+    ExtensionsParser extensionsParser("permessage-deflate; client_no_context_takeover");
+    string response;
+    PerMessageDeflate perMessageDeflate(extensionsParser, false, false, 15, 15, 8, &zlibPool, response);
+    vector<char> inflated(BUFFER_SIZE);
+    for (size_t size : {128, 4096, 65536}) {
+        string message = text(size, random);
+        vector<char> compressed(size + 64);
+        z_stream *stream = zlibPool.getDeflateStream(15, 8);
+        size_t compressedLength = PerMessageDeflate::deflate(stream, (char *) message.data(), size, compressed.data(), compressed.size(), true);
+        zlibPool.putDeflateStream(stream, 15, 8);
+
+        measure("PerMessageDeflate::inflate " + to_string(size), size, [&]() {
+            bool full;
+            perMessageDeflate.setInput(compressed.data(), compressedLength);
+            sink = perMessageDeflate.inflate(inflated.data(), inflated.size(), true, full);
+            perMessageDeflate.releaseReadStream();
+        });
+    }
+    return 0;
+}
@@ -9,21 +9,35 @@
 #include <vector>
 #include <mutex>
 #include <thread>
+#include <sys/wait.h>
+#include <signal.h>
+#include <openssl/ssl.h>
+#include <uWS.h>
 using namespace std;
 using namespace chrono;
 
 int totalConnections = 500000;
 int port = 3000;
+bool perMessageDeflate = false;
+SSL_CTX *clientContext = nullptr;
+vector<pair<int, SSL *>> sockets;
 
 #define CONNECTIONS_PER_ADDRESS 28000
 #define THREADS 10
 
-int connections, address = 1;
+int connections, started, address = 1;
+bool quiet = false;
 mutex m;
 
 bool nextConnection(int tid)
 {
     m.lock();
+    // every connection is reserved up front so exactly totalConnections get made
+    if (started == totalConnections) {
+        m.unlock();
+        return false;
+    }
+    started++;
     int socketfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     if (socketfd == -1) {
         cout << "FD error, connections: " << connections << endl;
@@ -37,14 +51,23 @@ bool nextConnection(int tid)
     m.unlock();
 
     // this is a shared upgrade, no need to make it unique
-    const char *buf = "GET /default HTTP/1.1\r\n"
-                      "Host: server.example.com\r\n"
-                      "Upgrade: websocket\r\n"
-                      "Connection: Upgrade\r\n"
-                      "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
-                      "Sec-WebSocket-Protocol: default\r\n"
-                      "Sec-WebSocket-Version: 13\r\n"
-                      "Origin: http://example.com\r\n\r\n";
+    const char *buf = perMessageDeflate ? "GET /default HTTP/1.1\r\n"
+                                          "Host: server.example.com\r\n"
+                                          "Upgrade: websocket\r\n"
+                                          "Connection: Upgrade\r\n"
+                                          "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                                          "Sec-WebSocket-Protocol: default\r\n"
+                                          "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+                                          "Sec-WebSocket-Version: 13\r\n"
+                                          "Origin: http://example.com\r\n\r\n"
+                                        : "GET /default HTTP/1.1\r\n"
+                                          "Host: server.example.com\r\n"
+                                          "Upgrade: websocket\r\n"
+                                          "Connection: Upgrade\r\n"
+                                          "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                                          "Sec-WebSocket-Protocol: default\r\n"
+                                          "Sec-WebSocket-Version: 13\r\n"
+                                          "Origin: http://example.com\r\n\r\n";
 
     char message[1024];
 
@@ -53,24 +76,42 @@ bool nextConnection(int tid)
         cout << "Connection error, connections: " << connections << endl;
         return false;
     }
-    send(socketfd, buf, strlen(buf), 0);
+
+    // certificates are not verified, only what the server holds per connection matters here
+    SSL *ssl = nullptr;
+    if (clientContext) {
+        ssl = SSL_new(clientContext);
+        SSL_set_fd(ssl, socketfd);
+        if (SSL_connect(ssl) != 1) {
+            cout << "TLS error, connections: " << connections << endl;
+            return false;
+        }
+        SSL_write(ssl, buf, strlen(buf));
+    } else {
+        send(socketfd, buf, strlen(buf), 0);
+    }
     memset(message, 0, 1024);
-    size_t length;
+    int length;
     do {
-        length = recv(socketfd, message, sizeof(message), 0);
+        length = ssl ? SSL_read(ssl, message, sizeof(message)) : recv(socketfd, message, sizeof(message), 0);
+        if (length < 4) {
+            cout << "Upgrade error, connections: " << connections << endl;
+            return false;
+        }
     }
     while (strncmp(&message[length - 4], "\r\n\r\n", 4));
 
     m.lock();
+    sockets.push_back({socketfd, ssl});
     if (++connections % CONNECTIONS_PER_ADDRESS == 0) {
         address++;
     }
 
-    if (connections % 1000 == 0 || connections < 1000) {
+    if (!quiet && (connections % 1000 == 0 || connections < 1000)) {
         cout << "Connections: " << connections << endl;
     }
 
-    if (connections >= totalConnections - THREADS + 1) {
+    if (connections >= totalConnections) {
         m.unlock();
         return false;
     }
@@ -79,15 +120,152 @@ bool nextConnection(int tid)
     return true;
 }
 
+void connectAll()
+{
+    vector<thread *> threads;
+    for (int i = 0; i < THREADS; i++) {
+        threads.push_back(new thread([i] {
+            while(nextConnection(i));
+        }));
+    }
+
+    for (thread *t : threads) {
+        t->join();
+        delete t;
+    }
+}
+
+long residentBytes()
+{
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        fscanf(statm, "%*s %ld", &pages);
+        fclose(statm);
+    }
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// the server runs in a child process of its own with the library accounting for every layer, this process only connects
+void breakdown(string mode)
+{
+    int ready[2];
+    if (pipe(ready)) {
+        return;
+    }
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (!pid) {
+        close(ready[0]);
+
+        uWS::EventSystem es(uWS::MASTER);
+        uWS::Server *server;
+        try {
+            if (mode == "ssl") {
+                server = new uWS::Server(es, port, uWS::NO_OPTIONS, 0, uWS::SSLContext("cert.pem", "key.pem"));
+            } else if (mode == "deflate" || mode.find("deflate/") == 0) {
+                // deflate/windowBits/memLevel sets both windows and the memLevel through setCompressionMemory
+                server = new uWS::Server(es, port, uWS::PERMESSAGE_DEFLATE, 0);
+                int windowBits, memLevel;
+                if (sscanf(mode.c_str(), "deflate/%d/%d", &windowBits, &memLevel) == 2) {
+                    server->setCompressionMemory(windowBits, windowBits, memLevel);
+                }
+            } else if (mode == "deflate-nct") {
+                server = new uWS::Server(es, port, uWS::PERMESSAGE_DEFLATE | uWS::SERVER_NO_CONTEXT_TAKEOVER | uWS::CLIENT_NO_CONTEXT_TAKEOVER, 0);
+            } else {
+                server = new uWS::Server(es, port, uWS::NO_OPTIONS, 0);
+            }
+        } catch (...) {
+            cout << "ERR_LISTEN, ERR_SSL (is there a cert.pem and key.pem?) or ERR_ZLIB" << endl;
+            _exit(-1);
+        }
+
+        static long rssBefore, sslBefore;
+        static int connected;
+        rssBefore = residentBytes();
+        sslBefore = uWS::SSLContext::getMemoryUsage();
+
+        // bytes per connection, rss also holds whatever no layer accounts for, kernel memory is not part of it
+        server->onConnection([mode, server](uWS::WebSocket socket) {
+            if (++connected < totalConnections) {
+                return;
+            }
+            uWS::MemoryUsage usage = server->getMemoryUsage();
+            double n = usage.sockets, ssl = uWS::SSLContext::getMemoryUsage() - sslBefore;
+            double accounted = usage.poll + usage.socketData + usage.queue + usage.buffers + usage.zlib + ssl;
+            printf("%-12s %11llu %8.0f %10.0f %8.0f %8.0f %8.0f %8.0f %8.0f %10.0f %8.0f\n", mode.c_str(), usage.sockets,
+                   usage.poll / n, usage.socketData / n, usage.queue / n, usage.buffers / n, usage.zlib / n, ssl / n, usage.kernel / n,
+                   accounted / n, (residentBytes() - rssBefore) / n);
+            fflush(stdout);
+            _exit(0);
+        });
+
+        char byte = 1;
+        if (write(ready[1], &byte, 1) != 1) {
+            _exit(-1);
+        }
+        es.run();
+        _exit(0);
+    }
+
+    close(ready[1]);
+    char byte;
+    if (read(ready[0], &byte, 1) == 1) {
+        connections = started = 0;
+        clientContext = mode == "ssl" ? SSL_CTX_new(SSLv23_client_method()) : nullptr;
+        perMessageDeflate = mode.find("deflate") == 0;
+        connectAll();
+    }
+    close(ready[0]);
+    if (connections < totalConnections) {
+        kill(pid, SIGTERM);
+    }
+    waitpid(pid, nullptr, 0);
+
+    for (pair<int, SSL *> &socket : sockets) {
+        if (socket.second) {
+            SSL_free(socket.second);
+        }
+        close(socket.first);
+    }
+    sockets.clear();
+    if (clientContext) {
+        SSL_CTX_free(clientContext);
+        clientContext = nullptr;
+    }
+}
+
 int main(int argc, char **argv)
 {
-    if (argc != 3) {
-        cout << "Usage: scalability numberOfConnections port" << endl;
+    if (argc >= 4 && !strcmp(argv[1], "breakdown")) {
+        totalConnections = atoi(argv[2]);
+        port = atoi(argv[3]);
+        quiet = true;
+        // before anything uses OpenSSL, the children inherit it
+        uWS::SSLContext::trackMemory();
+        vector<string> modes = {"plain", "ssl", "deflate", "deflate-nct"};
+        if (argc > 4) {
+            modes.assign(argv + 4, argv + argc);
+        }
+
+        printf("%-12s %11s %8s %10s %8s %8s %8s %8s %8s %10s %8s\n", "mode", "connections", "poll", "socketData", "queue", "buffers",
+               "zlib", "ssl", "kernel", "accounted", "rss");
+        for (string &mode : modes) {
+            breakdown(mode);
+        }
+        return 0;
+    }
+
+    if (argc != 3 && argc != 4) {
+        cout << "Usage: scalability numberOfConnections port [deflate]" << endl;
+        cout << "       scalability breakdown numberOfConnections port [plain] [ssl] [deflate] [deflate/windowBits/memLevel] [deflate-nct]" << endl;
         return -1;
     }
 
     totalConnections = atoi(argv[1]);
     port = atoi(argv[2]);
+    perMessageDeflate = argc == 4 && !strcmp(argv[3], "deflate");
 
     FILE *pipe = popen(("fuser " + to_string(port) + "/tcp 2> /dev/null").c_str(), "r");
     char line[10240] = {};
@@ -96,16 +274,7 @@ int main(int argc, char **argv)
     int pid = atoi(line);
 
     auto startPoint = high_resolution_clock::now();
-    vector<thread *> threads;
-    for (int i = 0; i < THREADS; i++) {
-        threads.push_back(new thread([i] {
-            while(nextConnection(i));
-        }));
-    }
-
-    for (thread *t : threads) {
-        t->join();
-    }
+    connectAll();
 
     double connectionsPerMs = double(connections) / duration_cast<milliseconds>(high_resolution_clock::now() - startPoint).count();
     cout << "Connection performance: " << connectionsPerMs << " connections/ms" << endl;
@@ -116,6 +285,7 @@ int main(int argc, char **argv)
 
     unsigned long kbUsage = atoi(strrchr(line, ' '));
     cout << "Memory performance: " << 1024.0 * double(connections) / kbUsage << " connections/mb" << endl;
+    cout << "Memory per connection: " << 1024.0 * kbUsage / connections << " bytes" << endl;
     return 0;
 }
 
@@ -0,0 +1,140 @@
+/* TLS upgrade rate of reconnecting clients: full handshakes against resumed ones, by ticket and by session id */
+/* needs cert.pem and key.pem in the working directory, a self-signed pair is fine */
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <openssl/ssl.h>
+#include <uWS.h>
+using namespace std;
+using namespace chrono;
+
+const char upgradeRequest[] = "GET / HTTP/1.1\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                              "Host: localhost\r\n"
+                              "Sec-WebSocket-Version: 13\r\n\r\n";
+
+double cpuTime()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6 * (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+// connects, upgrades and leaves, returns the session to resume next time
+SSL_SESSION *reconnect(SSL_CTX *context, int port, SSL_SESSION *session, bool &resumed)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    // TLS writes a record per send, Nagle would hold back every one after the first
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    if (connect(fd, (sockaddr *) &addr, sizeof(addr))) {
+        cout << "Connection error" << endl;
+        exit(-1);
+    }
+
+    SSL *ssl = SSL_new(context);
+    SSL_set_fd(ssl, fd);
+    if (session) {
+        SSL_set_session(ssl, session);
+    }
+    if (SSL_connect(ssl) != 1 || SSL_write(ssl, upgradeRequest, sizeof(upgradeRequest) - 1) != sizeof(upgradeRequest) - 1) {
+        cout << "TLS handshake error" << endl;
+        exit(-1);
+    }
+
+    // TLS 1.3 tickets arrive after the handshake, reading the 101 picks them up
+    string head;
+    for (char c; head.find("\r\n\r\n") == string::npos; head += c) {
+        if (SSL_read(ssl, &c, 1) != 1) {
+            cout << "Upgrade error" << endl;
+            exit(-1);
+        }
+    }
+
+    resumed = SSL_session_reused(ssl);
+    SSL_SESSION *next = SSL_get1_session(ssl);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    close(fd);
+    return next;
+}
+
+void measure(const char *name, SSL_CTX *context, int port, int handshakes, bool resume)
+{
+    SSL_SESSION *session = nullptr;
+    int resumed = 0;
+    double cpuStart = cpuTime();
+    auto start = high_resolution_clock::now();
+    for (int i = 0; i < handshakes; i++) {
+        bool reused;
+        SSL_SESSION *next = reconnect(context, port, session, reused);
+        resumed += reused;
+        if (session) {
+            SSL_SESSION_free(session);
+        }
+        session = resume ? next : (SSL_SESSION_free(next), nullptr);
+    }
+    double elapsed = duration_cast<microseconds>(high_resolution_clock::now() - start).count() * 1e-6;
+    double cpu = cpuTime() - cpuStart;
+    if (session) {
+        SSL_SESSION_free(session);
+    }
+
+    cout << name << ": " << handshakes / elapsed << " upgrades/s, " << 1e6 * cpu / handshakes << " µs cpu per upgrade (client and server), "
+         << resumed << "/" << handshakes << " resumed" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int handshakes = argc > 1 ? atoi(argv[1]) : 2000;
+    int port = argc > 2 ? atoi(argv[2]) : 3000;
+
+    atomic<bool> listening(false);
+    thread([port, &listening] {
+        try {
+            uWS::EventSystem es(uWS::MASTER);
+            uWS::SSLContext sslContext("cert.pem", "key.pem");
+            sslContext.setSessionCache(20480, 300);
+            sslContext.setTicketRotation(3600);
+            uWS::Server server(es, port, uWS::NO_OPTIONS, 1048576, sslContext);
+            listening = true;
+            es.run();
+        } catch (...) {
+            cout << "ERR_LISTEN or ERR_SSL (is there a cert.pem and key.pem?)" << endl;
+            exit(-1);
+        }
+    }).detach();
+
+    while (!listening) {
+        this_thread::sleep_for(milliseconds(10));
+    }
+
+    SSL_CTX *tls13 = SSL_CTX_new(TLS_client_method());
+    SSL_CTX *tls12 = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_max_proto_version(tls12, TLS1_2_VERSION);
+    SSL_CTX *sessionId = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_max_proto_version(sessionId, TLS1_2_VERSION);
+    SSL_CTX_set_options(sessionId, SSL_OP_NO_TICKET);
+
+    measure("TLS 1.3 full      ", tls13, port, handshakes, false);
+    measure("TLS 1.3 ticket    ", tls13, port, handshakes, true);
+    measure("TLS 1.2 full      ", tls12, port, handshakes, false);
+    measure("TLS 1.2 ticket    ", tls12, port, handshakes, true);
+    measure("TLS 1.2 session id", sessionId, port, handshakes, true);
+}
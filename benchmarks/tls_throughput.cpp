@@ -0,0 +1,174 @@
+/* TLS echo throughput of one connection, once through OpenSSL and once with the record layer in the kernel */
+/* needs cert.pem and key.pem in the working directory, a self-signed pair is fine */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <uWS.h>
+using namespace std;
+using namespace chrono;
+
+const char upgradeRequest[] = "GET / HTTP/1.1\r\n"
+                              "Upgrade: websocket\r\n"
+                              "Connection: Upgrade\r\n"
+                              "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                              "Host: localhost\r\n"
+                              "Sec-WebSocket-Version: 13\r\n\r\n";
+
+bool readFully(SSL *ssl, char *dst, size_t length)
+{
+    while (length) {
+        int received = SSL_read(ssl, dst, length);
+        if (received <= 0) {
+            return false;
+        }
+        dst += received;
+        length -= received;
+    }
+    return true;
+}
+
+bool writeFully(SSL *ssl, const char *src, size_t length)
+{
+    while (length) {
+        int sent = SSL_write(ssl, src, length);
+        if (sent <= 0) {
+            return false;
+        }
+        src += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// the kernel counts connections it encrypts (TlsTxSw) and decrypts (TlsRxSw) itself
+string tlsStat()
+{
+    ifstream stat("/proc/net/tls_stat");
+    string line, counters;
+    while (getline(stat, line)) {
+        if (!line.compare(0, 7, "TlsTxSw") || !line.compare(0, 7, "TlsRxSw")) {
+            counters += line.substr(0, line.find_first_of(" \t")) + "=" + line.substr(line.find_last_of(" \t") + 1) + " ";
+        }
+    }
+    return counters.length() ? counters : "unavailable (tls module not loaded)";
+}
+
+double measure(int port, size_t payload, int seconds)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    // TLS writes a record per send, Nagle would hold back every one after the first
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+    if (connect(fd, (sockaddr *) &addr, sizeof(addr))) {
+        cout << "Connection error" << endl;
+        exit(-1);
+    }
+
+    SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+    SSL *ssl = SSL_new(context);
+    SSL_set_fd(ssl, fd);
+    if (SSL_connect(ssl) != 1 || !writeFully(ssl, upgradeRequest, sizeof(upgradeRequest) - 1)) {
+        cout << "TLS handshake error" << endl;
+        exit(-1);
+    }
+
+    string head;
+    for (char c; head.find("\r\n\r\n") == string::npos; head += c) {
+        if (SSL_read(ssl, &c, 1) != 1) {
+            cout << "Upgrade error" << endl;
+            exit(-1);
+        }
+    }
+
+    // one binary frame masked with zeros so the payload goes out as is
+    vector<char> frame(14 + payload, 'x');
+    size_t headerLength;
+    frame[0] = (char) 130;
+    if (payload < 126) {
+        frame[1] = (char) (128 | payload);
+        headerLength = 6;
+    } else if (payload <= UINT16_MAX) {
+        frame[1] = (char) (128 | 126);
+        *((uint16_t *) &frame[2]) = htons(payload);
+        headerLength = 8;
+    } else {
+        frame[1] = (char) (128 | 127);
+        *((uint64_t *) &frame[2]) = htobe64(payload);
+        headerLength = 14;
+    }
+    memset(&frame[headerLength - 4], 0, 4);
+    frame.resize(headerLength + payload);
+    vector<char> echo(headerLength - 4 + payload);
+
+    unsigned long long bytes = 0;
+    auto start = high_resolution_clock::now();
+    while (high_resolution_clock::now() - start < std::chrono::seconds(seconds)) {
+        if (!writeFully(ssl, frame.data(), frame.size()) || !readFully(ssl, echo.data(), echo.size())) {
+            cout << "Echo error" << endl;
+            exit(-1);
+        }
+        bytes += 2 * payload;
+    }
+    double elapsed = duration_cast<microseconds>(high_resolution_clock::now() - start).count();
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    SSL_CTX_free(context);
+    close(fd);
+    return bytes / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t payload = argc > 1 ? atoi(argv[1]) : 262144;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    int port = argc > 3 ? atoi(argv[3]) : 3000;
+
+    atomic<bool> listening(false);
+    thread([port, &listening] {
+        try {
+            uWS::EventSystem es(uWS::MASTER);
+            uWS::SSLContext sslContext("cert.pem", "key.pem");
+            uWS::Server userspace(es, port, uWS::NO_OPTIONS, 0, sslContext);
+            uWS::Server kernel(es, port + 1, uWS::KERNEL_TLS, 0, sslContext);
+            for (uWS::Server *server : {&userspace, &kernel}) {
+                server->onMessage([](uWS::WebSocket socket, char *message, size_t length, uWS::OpCode opCode) {
+                    socket.send(message, length, opCode);
+                });
+            }
+            listening = true;
+            es.run();
+        } catch (...) {
+            cout << "ERR_LISTEN or ERR_SSL (is there a cert.pem and key.pem?)" << endl;
+            exit(-1);
+        }
+    }).detach();
+
+    while (!listening) {
+        this_thread::sleep_for(milliseconds(10));
+    }
+
+    cout << "Payload: " << payload << " bytes, " << seconds << " s per run" << endl;
+    cout << "OpenSSL records: " << measure(port, payload, seconds) << " MB/s" << endl;
+    string before = tlsStat();
+    cout << "Kernel TLS:      " << measure(port + 1, payload, seconds) << " MB/s" << endl;
+    cout << "/proc/net/tls_stat before: " << before << endl;
+    cout << "/proc/net/tls_stat after:  " << tlsStat() << endl;
+}
@@ -0,0 +1,33 @@
+/* this is an echo client, it connects to the url given (the echo example by default) and prints what comes back */
+
+#include <iostream>
+#include <string>
+using namespace std;
+
+#include <uWS.h>
+using namespace uWS;
+
+int main(int argc, char *argv[])
+{
+    EventSystem es(MASTER);
+    Server clients(es, 0, PERMESSAGE_DEFLATE);
+
+    clients.onConnection([](WebSocket socket) {
+        string hello = "Hello from " + string((char *) socket.getData());
+        socket.send(hello.data(), hello.length(), TEXT);
+    });
+
+    clients.onMessage([](WebSocket socket, char *message, size_t length, OpCode opCode) {
+        cout << "[Message] " << string(message, length) << endl;
+        socket.close();
+    });
+
+    clients.onConnectionError([](void *user) {
+        cout << "Could not connect to " << (char *) user << endl;
+    });
+
+    char *url = (char *) (argc > 1 ? argv[1] : "ws://localhost:3000");
+    es.connect(url, &clients, url);
+    es.run();
+    return 0;
+}
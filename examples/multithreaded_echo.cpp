@@ -20,9 +20,9 @@ int main()
         EventSystem es(MASTER);
         Server server(es, 3000);
 
-        server.onUpgrade([](uv_os_fd_t fd, const char *secKey, void *ssl, const char *extensions, size_t extensionsLength) {
-            // we transfer the connection to one of the other servers
-            threadedServer[rand() % THREADS]->upgrade(fd, secKey, ssl, extensions, extensionsLength);
+        // we transfer every accepted connection to one of the other servers, the handshake runs there
+        server.onAccept([](uv_os_sock_t fd, void *ssl) {
+            threadedServer[rand() % THREADS]->adopt(fd, ssl);
         });
 
         // launch the threads with their servers
@@ -24,9 +24,9 @@ int main()
         EventSystem wes(WORKER);
         Server worker(wes, 0, PERMESSAGE_DEFLATE | SERVER_NO_CONTEXT_TAKEOVER | CLIENT_NO_CONTEXT_TAKEOVER, 0);
 
-        server.onUpgrade([&worker](uv_os_sock_t fd, const char *secKey, void *ssl, const char *extensions, size_t extensionsLength) {
+        server.onUpgrade([&worker](uv_os_sock_t fd, const char *secKey, void *ssl, const char *extensions, size_t extensionsLength, const char *buffered, size_t bufferedLength, HTTPRequest request) {
             // transfer connection to one of our worker servers
-            worker.upgrade(fd, secKey, ssl, extensions, extensionsLength);
+            worker.upgrade(fd, secKey, ssl, extensions, extensionsLength, buffered, bufferedLength);
         });
 
         // our working server, does not listen
@@ -224,12 +224,13 @@ void upgrade(const FunctionCallbackInfo<Value> &args)
     Local<Object> ticket = args[0]->ToObject();
     NativeString secKey(args[1]);
     NativeString extensions(args[2]);
+    NativeString buffered(args[3]);
 
     uv_os_sock_t *fd = (uv_os_sock_t *) ticket->GetAlignedPointerFromInternalField(0);
     SSL *ssl = (SSL *) ticket->GetAlignedPointerFromInternalField(1);
 
     if (*fd != INVALID_SOCKET) {
-        server->upgrade(*fd, secKey.getData(), ssl, extensions.getData(), extensions.getLength());
+        server->upgrade(*fd, secKey.getData(), ssl, extensions.getData(), extensions.getLength(), buffered.getData(), buffered.getLength());
     } else {
         if (ssl) {
             SSL_free(ssl);
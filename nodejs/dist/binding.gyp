@@ -5,11 +5,15 @@
       'sources': [
         'src/Extensions.cpp',
         'src/HTTPSocket.cpp',
+        'src/Metrics.cpp',
         'src/Network.cpp',
+        'src/Offload.cpp',
         'src/Server.cpp',
+        'src/StaticFiles.cpp',
         'src/UTF8.cpp',
         'src/WebSocket.cpp',
         'src/EventSystem.cpp',
+        'src/ClientSocket.cpp',
         'src/addon.cpp'
       ],
       'conditions': [
@@ -0,0 +1,302 @@
+#include "ClientSocket.h"
+#include "Server.h"
+#include "WebSocket.h"
+#include "Extensions.h"
+#include "SocketData.h"
+#include "Parser.h"
+#include "Network.h"
+
+#include <cstring>
+#include <openssl/ssl.h>
+#include <openssl/sha.h>
+#include <openssl/rand.h>
+
+void base64(const unsigned char *src, size_t length, char *dst);
+
+namespace uWS {
+
+// the key is 16 random bytes and the answer it needs is known before anything is sent
+ClientSocket::ClientSocket(Server *server, void *user, void *ssl, std::string authority, std::string path) : server(server), user(user), ssl(ssl)
+{
+    unsigned char nonce[16];
+    RAND_bytes(nonce, sizeof(nonce));
+    char secKey[24];
+    base64(nonce, sizeof(nonce), secKey);
+
+    unsigned char shaInput[] = "XXXXXXXXXXXXXXXXXXXXXXXX258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    memcpy(shaInput, secKey, 24);
+    unsigned char shaDigest[SHA_DIGEST_LENGTH];
+    SHA1(shaInput, sizeof(shaInput) - 1, shaDigest);
+    base64(shaDigest, SHA_DIGEST_LENGTH, accept);
+
+    request = "GET " + path + " HTTP/1.1\r\n"
+              "Host: " + authority + "\r\n"
+              "Upgrade: websocket\r\n"
+              "Connection: Upgrade\r\n"
+              "Sec-WebSocket-Key: " + std::string(secKey, 24) + "\r\n"
+              "Sec-WebSocket-Version: 13\r\n";
+    if (server->options & PERMESSAGE_DEFLATE) {
+        request += "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n";
+    }
+    request += "\r\n";
+    resolver.data = this;
+}
+
+uv_os_sock_t ClientSocket::stop()
+{
+    uv_os_sock_t fd;
+    uv_fileno((uv_handle_t *) p, (uv_os_fd_t *) &fd);
+
+    uv_poll_stop(p);
+    uv_close((uv_handle_t *) p, [](uv_handle_t *handle) {
+        delete (uv_poll_t *) handle;
+    });
+
+    uv_timer_stop(t);
+    uv_close((uv_handle_t *) t, [](uv_handle_t *handle) {
+        delete (uv_timer_t *) handle;
+    });
+
+    return fd;
+}
+
+// the connection never became a WebSocket, whatever got that far is undone before onConnectionError
+void ClientSocket::fail()
+{
+    if (ssl) {
+        SSL_free((SSL *) ssl);
+    }
+    if (p) {
+        ::close(stop());
+    }
+    server->connectionErrorCallback(user);
+    delete this;
+}
+
+void ClientSocket::onTimeout(uv_timer_t *t)
+{
+    ((ClientSocket *) t->data)->server->metrics.handshakeTimeouts.add();
+    ((ClientSocket *) t->data)->fail();
+}
+
+// only the first address is tried, the timeout runs from here
+void ClientSocket::onResolved(uv_getaddrinfo_t *resolver, int status, addrinfo *result)
+{
+    ClientSocket *clientSocket = (ClientSocket *) resolver->data;
+    if (status < 0) {
+        clientSocket->fail();
+        return;
+    }
+
+    uv_os_sock_t fd = socket(result->ai_family, SOCK_STREAM, 0);
+    if (fd == INVALID_SOCKET) {
+        uv_freeaddrinfo(result);
+        clientSocket->fail();
+        return;
+    }
+
+#ifdef __APPLE__
+    int noSigpipe = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigpipe, sizeof(int));
+#endif
+
+    // same as accepted sockets, the upgrade request would otherwise wait behind the TLS Finished
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+
+    // the poll makes the socket non-blocking before connect
+    clientSocket->p = new uv_poll_t;
+    uv_poll_init_socket(clientSocket->server->loop, clientSocket->p, fd);
+    clientSocket->p->data = clientSocket;
+
+    clientSocket->t = new uv_timer_t;
+    uv_timer_init(clientSocket->server->loop, clientSocket->t);
+    uv_timer_start(clientSocket->t, onTimeout, TIMEOUT, 0);
+    clientSocket->t->data = clientSocket;
+
+    int connected = ::connect(fd, result->ai_addr, result->ai_addrlen);
+    uv_freeaddrinfo(result);
+#ifdef _WIN32
+    if (connected && WSAGetLastError() != WSAEWOULDBLOCK) {
+#else
+    if (connected && errno != EINPROGRESS) {
+#endif
+        clientSocket->fail();
+        return;
+    }
+
+    if (clientSocket->ssl) {
+        SSL_set_fd((SSL *) clientSocket->ssl, fd);
+    }
+    uv_poll_start(clientSocket->p, UV_WRITABLE, onPoll);
+}
+
+// every step polls for what it waits on and continues here
+void ClientSocket::onPoll(uv_poll_t *p, int status, int events)
+{
+    ClientSocket *clientSocket = (ClientSocket *) p->data;
+    SSL *ssl = (SSL *) clientSocket->ssl;
+    clientSocket->server->es.event();
+    if (status < 0) {
+        clientSocket->fail();
+        return;
+    }
+
+    uv_os_sock_t fd;
+    uv_fileno((uv_handle_t *) p, (uv_os_fd_t *) &fd);
+
+    if (clientSocket->state == CONNECTING) {
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char *) &error, &errorLength) || error) {
+            clientSocket->fail();
+            return;
+        }
+        clientSocket->state = ssl ? HANDSHAKING : REQUESTING;
+    }
+
+    if (clientSocket->state == HANDSHAKING) {
+        int result = SSL_do_handshake(ssl);
+        if (result != 1) {
+            switch (SSL_get_error(ssl, result)) {
+            case SSL_ERROR_WANT_READ:
+                uv_poll_start(p, UV_READABLE, onPoll);
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                uv_poll_start(p, UV_WRITABLE, onPoll);
+                break;
+            default:
+                clientSocket->fail();
+            }
+            return;
+        }
+        clientSocket->state = REQUESTING;
+    }
+
+    if (clientSocket->state == REQUESTING) {
+        while (clientSocket->requestOffset < clientSocket->request.length()) {
+            const char *data = clientSocket->request.data() + clientSocket->requestOffset;
+            int length = clientSocket->request.length() - clientSocket->requestOffset;
+            ssize_t sent = ssl ? SSL_write(ssl, data, length) : ::send(fd, data, length, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                if (ssl) {
+                    int error = SSL_get_error(ssl, sent);
+                    if (error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) {
+                        clientSocket->fail();
+                        return;
+                    }
+                } else {
+#ifdef _WIN32
+                    if (WSAGetLastError() != WSAENOBUFS && WSAGetLastError() != WSAEWOULDBLOCK) {
+#else
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+#endif
+                        clientSocket->fail();
+                        return;
+                    }
+                }
+                uv_poll_start(p, UV_WRITABLE, onPoll);
+                return;
+            }
+            clientSocket->requestOffset += sent;
+        }
+        clientSocket->state = AWAITING;
+        uv_poll_start(p, UV_READABLE, onPoll);
+        return;
+    }
+
+    // whatever follows the head has to fit the receive buffer once the head is cut off
+    char *recvBuffer = clientSocket->server->recvBuffer;
+    int length;
+    if (ssl) {
+        length = SSL_read(ssl, recvBuffer, Server::LARGE_BUFFER_SIZE - MAX_HEADER_BUFFER_LENGTH);
+        if (length < 1) {
+            switch (SSL_get_error(ssl, length)) {
+            case SSL_ERROR_WANT_WRITE:
+            case SSL_ERROR_WANT_READ:
+                return;
+            }
+        }
+    } else {
+        length = recv(fd, recvBuffer, Server::LARGE_BUFFER_SIZE - MAX_HEADER_BUFFER_LENGTH, 0);
+    }
+
+    if (length == SOCKET_ERROR || length == 0) {
+        clientSocket->fail();
+        return;
+    }
+
+    clientSocket->response.append(recvBuffer, length);
+    size_t headLength = clientSocket->parser.consume(clientSocket->response.data(), clientSocket->response.length());
+    if (!headLength) {
+        if (clientSocket->response.length() > MAX_HEADER_BUFFER_LENGTH) {
+            clientSocket->fail();
+        }
+        return;
+    }
+    clientSocket->upgraded(headLength);
+}
+
+// the socket joins the clients of server with user as its data, frames that came along with the answer are parsed right away
+void ClientSocket::upgraded(size_t headLength)
+{
+    // a status line splits like a request line, the status code takes the place of the url
+    HTTPRequest head;
+    Header headers[HTTPParser::MAX_HEADERS];
+    HTTPParser::parse((char *) response.data(), headLength, head, headers);
+
+    Header upgrade = head.getHeader("upgrade", 7);
+    Header secAccept = head.getHeader("sec-websocket-accept", 20);
+    Header extensions = head.getHeader("sec-websocket-extensions", 24);
+
+    bool valid = head.urlLength == 3 && !memcmp(head.url, "101", 3) && upgrade && upgrade.valueLength == 9
+            && secAccept && secAccept.valueLength == 28 && !memcmp(secAccept.value, accept, 28);
+    for (unsigned int i = 0; valid && i < 9; i++) {
+        valid = (upgrade.value[i] | 32) == "websocket"[i];
+    }
+
+    PerMessageDeflate *perMessageDeflate = nullptr;
+    if (valid && extensions) {
+        ExtensionsParser extensionsParser(std::string(extensions.value, extensions.valueLength).c_str());
+        valid = (server->options & PERMESSAGE_DEFLATE) && extensionsParser.acceptableResponse();
+        if (valid) {
+            perMessageDeflate = new PerMessageDeflate(extensionsParser, server->memLevel, server->es.zlibPool);
+        }
+    }
+
+    if (!valid) {
+        fail();
+        return;
+    }
+
+    SSL *ssl = (SSL *) this->ssl;
+    uv_os_sock_t fd = stop();
+
+    uv_poll_t *clientPoll = new uv_poll_t;
+    WebSocket webSocket(clientPoll);
+    webSocket.initPoll(server, fd, ssl, perMessageDeflate);
+    SocketData *socketData = (SocketData *) clientPoll->data;
+    socketData->client = true;
+    socketData->data = user;
+
+    if (server->clients) {
+        webSocket.link(server->clients);
+    }
+    server->clients = clientPoll;
+    server->metrics.upgrades.add();
+    server->metrics.connections.add();
+    server->connectionCallback(webSocket);
+
+    if (response.length() > headLength && !uv_is_closing((uv_handle_t *) clientPoll) && socketData->state != CLOSING) {
+        memcpy(server->recvBuffer, response.data() + headLength, response.length() - headLength);
+        Parser::consume<false>(response.length() - headLength, server->recvBuffer, socketData, clientPoll);
+    }
+
+    // OpenSSL may hold more of what came along, the socket itself would not wake us for it
+    if (ssl && !uv_is_closing((uv_handle_t *) clientPoll) && SSL_has_pending(ssl)) {
+        WebSocket::onReadable(clientPoll, 0, UV_READABLE);
+    }
+    delete this;
+}
+
+}
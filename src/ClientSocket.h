@@ -0,0 +1,47 @@
+#ifndef CLIENTSOCKET_H
+#define CLIENTSOCKET_H
+
+#include <string>
+#include <uv.h>
+#include "HTTPParser.h"
+
+namespace uWS {
+
+class Server;
+
+// an outgoing connection until its upgrade is answered: resolve, connect, TLS handshake, request, response
+class ClientSocket {
+    friend class EventSystem;
+    static const int MAX_HEADER_BUFFER_LENGTH = 10240;
+    static const int TIMEOUT = 15000;
+
+    enum State {
+        CONNECTING,
+        HANDSHAKING,
+        REQUESTING,
+        AWAITING
+    } state = CONNECTING;
+
+    uv_getaddrinfo_t resolver;
+    uv_poll_t *p = nullptr;
+    uv_timer_t *t = nullptr;
+    Server *server;
+    void *user;
+    void *ssl;
+    std::string request, response;
+    size_t requestOffset = 0;
+    char accept[28];
+    HTTPParser parser;
+
+    ClientSocket(Server *server, void *user, void *ssl, std::string authority, std::string path);
+    uv_os_sock_t stop();
+    void fail();
+    void upgraded(size_t headLength);
+    static void onResolved(uv_getaddrinfo_t *resolver, int status, addrinfo *result);
+    static void onPoll(uv_poll_t *p, int status, int events);
+    static void onTimeout(uv_timer_t *t);
+};
+
+}
+
+#endif // CLIENTSOCKET_H
@@ -1,5 +1,12 @@
 #include "EventSystem.h"
 #include "WebSocket.h"
+#include "Extensions.h"
+#include "SocketData.h"
+#include "Server.h"
+#include "ClientSocket.h"
+
+#include <algorithm>
+#include <openssl/ssl.h>
 
 namespace uWS {
 
@@ -14,6 +21,37 @@ void EventSystem::changePollAsync(uv_poll_t *p)
 EventSystem::EventSystem(LoopType loopType) : loopType(loopType)
 {
     loop = loopType == MASTER ? uv_default_loop() : uv_loop_new();
+    zlibPool = new ZlibPool;
+
+    // TLS frames buffered during this iteration go out right before the loop waits again
+    recordFlush = new uv_prepare_t;
+    recordFlush->data = this;
+    uv_prepare_init(loop, recordFlush);
+    uv_prepare_start(recordFlush, [](uv_prepare_t *prepare) {
+        EventSystem *es = (EventSystem *) prepare->data;
+        while (!es->corked.empty()) {
+            uv_poll_t *p = es->corked.back();
+            es->corked.pop_back();
+            ((SocketData *) p->data)->corked = false;
+            uint64_t start = uv_hrtime();
+            WebSocket(p).flushRecords();
+            es->record(LOOP_FLUSH, p, uv_hrtime() - start);
+        }
+        es->endIteration();
+    });
+    uv_unref((uv_handle_t *) recordFlush);
+
+    // an iteration that only ran timers starts once polling returned
+    iterationCheck = new uv_check_t;
+    iterationCheck->data = this;
+    uv_check_init(loop, iterationCheck);
+    uv_check_start(iterationCheck, [](uv_check_t *check) {
+        EventSystem *es = (EventSystem *) check->data;
+        if (!es->iterationStart) {
+            es->iterationStart = uv_hrtime();
+        }
+    });
+    uv_unref((uv_handle_t *) iterationCheck);
 
     if (loopType == WORKER) {
         asyncPollChange = new uv_async_t;
@@ -31,8 +69,47 @@ EventSystem::EventSystem(LoopType loopType) : loopType(loopType)
     }
 }
 
+// a smoothed measure of how late a periodic timer fires, in milliseconds, started by the first server that needs it
+void EventSystem::measureLag()
+{
+    if (lagTimer) {
+        return;
+    }
+
+    lagTimer = new uv_timer_t;
+    lagTimer->data = this;
+    uv_timer_init(loop, lagTimer);
+    lagTimestamp = uv_hrtime();
+    uv_timer_start(lagTimer, [](uv_timer_t *t) {
+        EventSystem *es = (EventSystem *) t->data;
+        uint64_t now = uv_hrtime();
+        int64_t lag = (int64_t) (now - es->lagTimestamp) / 1000000 - LAG_INTERVAL;
+        es->loopLag = (es->loopLag * 3 + std::max<int64_t>(lag, 0)) / 4;
+        es->lagTimestamp = now;
+    }, LAG_INTERVAL, LAG_INTERVAL);
+    uv_unref((uv_handle_t *) lagTimer);
+}
+
 EventSystem::~EventSystem()
 {
+    delete zlibPool;
+    if (lagTimer) {
+        uv_timer_stop(lagTimer);
+        uv_close((uv_handle_t *) lagTimer, [](uv_handle_t *handle) {
+            delete (uv_timer_t *) handle;
+        });
+    }
+    uv_prepare_stop(recordFlush);
+    uv_close((uv_handle_t *) recordFlush, [](uv_handle_t *handle) {
+        delete (uv_prepare_t *) handle;
+    });
+    uv_check_stop(iterationCheck);
+    uv_close((uv_handle_t *) iterationCheck, [](uv_handle_t *handle) {
+        delete (uv_check_t *) handle;
+    });
+    if (clientContext) {
+        SSL_CTX_free((SSL_CTX *) clientContext);
+    }
     if (loopType == WORKER) {
         uv_loop_delete(loop);
     }
@@ -44,4 +121,115 @@ void EventSystem::run()
     uv_run(loop, UV_RUN_DEFAULT);
 }
 
+unsigned int EventSystem::getLoopLag()
+{
+    return loopLag;
+}
+
+// the loop is about to wait, everything since the iteration started was work
+void EventSystem::endIteration()
+{
+    if (!iterationStart) {
+        return;
+    }
+
+    uint64_t elapsed = uv_hrtime() - iterationStart;
+    iterations.add();
+    events.add(pendingEvents);
+    iterationTime.record(elapsed);
+    iterationEvents.record(pendingEvents);
+    iterationStart = 0;
+    pendingEvents = 0;
+    record(LOOP_ITERATION, nullptr, elapsed);
+}
+
+void EventSystem::record(LoopSection section, uv_poll_t *p, uint64_t elapsed)
+{
+    sectionTime[section].add(elapsed);
+    if (thresholds[section] && elapsed >= thresholds[section] && slowCallback) {
+        slowCallback(section, p && !uv_is_closing((uv_handle_t *) p) ? WebSocket(p) : WebSocket(), elapsed);
+    }
+}
+
+void EventSystem::setLoopThresholds(LoopThresholds thresholds)
+{
+    this->thresholds[LOOP_ITERATION] = thresholds.iteration;
+    this->thresholds[LOOP_CALLBACK] = thresholds.callback;
+    this->thresholds[LOOP_PARSE] = thresholds.parse;
+    this->thresholds[LOOP_FLUSH] = thresholds.flush;
+}
+
+void EventSystem::onSlow(std::function<void(LoopSection, WebSocket, uint64_t)> slowCallback)
+{
+    this->slowCallback = slowCallback;
+}
+
+LoopStats EventSystem::getLoopStats()
+{
+    LoopStats stats;
+    stats.iterations = iterations.get();
+    stats.events = events.get();
+    stats.callbackTime = sectionTime[LOOP_CALLBACK].get();
+    stats.parseTime = sectionTime[LOOP_PARSE].get();
+    stats.flushTime = sectionTime[LOOP_FLUSH].get();
+    stats.iterationTime = iterationTime;
+    stats.iterationEvents = iterationEvents;
+    return stats;
+}
+
+// wss:// peers are verified against the default trust store, SSL_CERT_FILE points it elsewhere
+void EventSystem::connect(std::string url, Server *server, void *user)
+{
+    bool secure = !url.compare(0, 6, "wss://");
+    if (!secure && url.compare(0, 5, "ws://")) {
+        server->connectionErrorCallback(user);
+        return;
+    }
+
+    size_t authorityStart = secure ? 6 : 5;
+    size_t pathStart = std::min(url.find('/', authorityStart), url.length());
+    std::string authority = url.substr(authorityStart, pathStart - authorityStart);
+    std::string path = pathStart < url.length() ? url.substr(pathStart) : "/";
+
+    // a colon behind the closing bracket of an IPv6 address starts the port
+    std::string host = authority, port = secure ? "443" : "80";
+    size_t colon = host.rfind(':');
+    if (colon != std::string::npos && host.find(']', colon) == std::string::npos) {
+        port = host.substr(colon + 1);
+        host.resize(colon);
+    }
+    if (host.length() > 1 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.length() - 2);
+    }
+
+    SSL *ssl = nullptr;
+    if (secure) {
+        if (!clientContext) {
+            SSL_CTX *context = SSL_CTX_new(SSLv23_client_method());
+            SSL_CTX_set_options(context, SSL_OP_NO_SSLv3);
+            SSL_CTX_set_default_verify_paths(context);
+            SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+            clientContext = context;
+        }
+        ssl = SSL_new((SSL_CTX *) clientContext);
+        // SNI is for names only, an address literal is checked against the IP entries of the certificate
+        unsigned char address[16];
+        if (!uv_inet_pton(AF_INET, host.c_str(), address) || !uv_inet_pton(AF_INET6, host.c_str(), address)) {
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str());
+        } else {
+            SSL_set_tlsext_host_name(ssl, host.c_str());
+            SSL_set1_host(ssl, host.c_str());
+        }
+        SSL_set_connect_state(ssl);
+    }
+
+    ClientSocket *clientSocket = new ClientSocket(server, user, ssl, authority, path);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (uv_getaddrinfo(loop, &clientSocket->resolver, ClientSocket::onResolved, host.c_str(), port.c_str(), &hints)) {
+        clientSocket->fail();
+    }
+}
+
 }
@@ -2,34 +2,111 @@
 #define EVENTSYSTEM_H
 
 #include <uv.h>
+#include <string>
 #include <vector>
 #include <mutex>
+#include <functional>
 #include "Network.h"
+#include "WebSocket.h"
+#include "Metrics.h"
+
+struct ZlibPool;
 
 namespace uWS {
 
+class Server;
+
 enum LoopType {
     MASTER,
     WORKER
 };
 
+enum LoopSection {
+    LOOP_ITERATION,
+    LOOP_CALLBACK,
+    LOOP_PARSE,
+    LOOP_FLUSH
+};
+
+// nanoseconds a section may take before onSlow hears of it, 0 leaves it unchecked
+struct LoopThresholds {
+    uint64_t iteration = 0;
+    uint64_t callback = 0;
+    uint64_t parse = 0;
+    uint64_t flush = 0;
+};
+
+// nanoseconds by section, an iteration runs from the first event after the loop woke up until it waits again
+struct LoopStats {
+    unsigned long long iterations = 0;
+    // socket callbacks, every readable or writable WebSocket, HTTP socket, client socket and listen socket is one
+    unsigned long long events = 0;
+    // the message callback
+    unsigned long long callbackTime = 0;
+    // Parser::consume, the callbacks it makes included
+    unsigned long long parseTime = 0;
+    // sending queued frames and packed TLS records
+    unsigned long long flushTime = 0;
+    MetricsSnapshot::Histogram iterationTime, iterationEvents;
+};
+
 class WIN32_EXPORT EventSystem
 {
     friend class Server;
     friend class WebSocket;
+    friend class HTTPSocket;
+    friend class ClientSocket;
+    friend struct DeflateJob;
     LoopType loopType;
     uv_loop_t *loop;
     uv_async_t *asyncPollChange;
     std::vector<uv_poll_t *> pollsToChange;
+    uv_prepare_t *recordFlush;
+    std::vector<uv_poll_t *> corked;
     std::mutex pollsToChangeMutex;
     pthread_t tid;
+    ZlibPool *zlibPool;
+    uv_timer_t *lagTimer = nullptr;
+    uint64_t lagTimestamp;
+    unsigned int loopLag = 0;
+    static const int LAG_INTERVAL = 100;
+    void *clientContext = nullptr;
+
+    uv_check_t *iterationCheck;
+    uint64_t iterationStart = 0;
+    unsigned int pendingEvents = 0;
+    Counter iterations, events, sectionTime[4];
+    MetricsHistogram iterationTime, iterationEvents;
+    uint64_t thresholds[4] = {};
+    std::function<void(LoopSection, WebSocket, uint64_t)> slowCallback;
 
     void changePollAsync(uv_poll_t *p);
+    void measureLag();
+    void endIteration();
+    // elapsed nanoseconds of a section, p is the socket it ran for
+    void record(LoopSection section, uv_poll_t *p, uint64_t elapsed);
+
+    // a socket callback, the first one after the loop woke up starts the iteration clock
+    void event() {
+        pendingEvents++;
+        if (!iterationStart) {
+            iterationStart = uv_hrtime();
+        }
+    }
 
 public:
     EventSystem(LoopType loopType = MASTER);
     ~EventSystem();
     void run();
+    // stays 0 unless a server with permessage-deflate lowers its compression level on lag
+    unsigned int getLoopLag();
+    void setLoopThresholds(LoopThresholds thresholds);
+    // from this loop's thread, the WebSocket is null for whole iterations and sockets that closed meanwhile
+    void onSlow(std::function<void(LoopSection section, WebSocket webSocket, uint64_t nanoseconds)> slowCallback);
+    // from any thread
+    LoopStats getLoopStats();
+    // ws:// or wss:// from this loop's thread, the socket shows up in onConnection of server with user as its data, or in onConnectionError
+    void connect(std::string url, Server *server, void *user = nullptr);
 };
 
 }
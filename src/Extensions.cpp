@@ -50,3 +50,18 @@ ExtensionsParser::ExtensionsParser(const char *in)
         }
     }
 }
+
+// zlib cannot produce raw deflate with a 256 byte window so such offers are declined, in either direction since a zlib
+// client asked for 8 quietly deflates with 9 and our 8 bit inflate would then fail
+bool ExtensionsParser::acceptable()
+{
+    return perMessageDeflate && (serverMaxWindowBits <= 1 || (serverMaxWindowBits >= 9 && serverMaxWindowBits <= 15))
+            && (clientMaxWindowBits <= 1 || (clientMaxWindowBits >= 9 && clientMaxWindowBits <= 15));
+}
+
+// the answer to our offer of client_max_window_bits, a bare parameter is only valid in offers
+bool ExtensionsParser::acceptableResponse()
+{
+    return perMessageDeflate && (!serverMaxWindowBits || (serverMaxWindowBits >= 8 && serverMaxWindowBits <= 15))
+            && (!clientMaxWindowBits || (clientMaxWindowBits >= 9 && clientMaxWindowBits <= 15));
+}
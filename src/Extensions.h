@@ -2,6 +2,9 @@
 #define EXTENSIONS_H
 
 #include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
 #include <zlib.h>
 
 enum ExtensionTokens {
@@ -24,51 +27,331 @@ public:
     int clientMaxWindowBits = 0;
 
     int getToken(const char **in);
+    bool acceptable();
+    bool acceptableResponse();
     ExtensionsParser(const char *in);
 };
 
+// zlib streams of one event loop, lent out for the length of one message on no-context-takeover sockets
+struct ZlibPool {
+    std::vector<z_stream *> inflateStreams;
+    std::vector<z_stream *> deflateStreams[16][MAX_MEM_LEVEL + 1];
+
+    z_stream *getInflateStream() {
+        if (inflateStreams.empty()) {
+            z_stream *stream = new z_stream({});
+            inflateInit2(stream, -15);
+            return stream;
+        }
+        z_stream *stream = inflateStreams.back();
+        inflateStreams.pop_back();
+        return stream;
+    }
+
+    void putInflateStream(z_stream *stream) {
+        inflateReset(stream);
+        inflateStreams.push_back(stream);
+    }
+
+    z_stream *getDeflateStream(int windowBits, int memLevel) {
+        std::vector<z_stream *> &streams = deflateStreams[windowBits][memLevel];
+        if (streams.empty()) {
+            z_stream *stream = new z_stream({});
+            deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, memLevel, Z_DEFAULT_STRATEGY);
+            return stream;
+        }
+        z_stream *stream = streams.back();
+        streams.pop_back();
+        return stream;
+    }
+
+    void putDeflateStream(z_stream *stream, int windowBits, int memLevel) {
+        deflateReset(stream);
+        deflateStreams[windowBits][memLevel].push_back(stream);
+    }
+
+    ~ZlibPool() {
+        for (z_stream *stream : inflateStreams) {
+            inflateEnd(stream);
+            delete stream;
+        }
+        for (auto &byWindowBits : deflateStreams) {
+            for (std::vector<z_stream *> &streams : byWindowBits) {
+                for (z_stream *stream : streams) {
+                    deflateEnd(stream);
+                    delete stream;
+                }
+            }
+        }
+    }
+};
+
+// a direction without context takeover only holds a stream while a message is in flight
 struct PerMessageDeflate {
-    z_stream readStream, writeStream;
+    z_stream *readStream = nullptr, *writeStream = nullptr;
+    ZlibPool *zlibPool;
     bool compressedFrame;
     bool serverNoContextTakeover = false;
     bool clientNoContextTakeover = false;
+    bool sharedWriteStream;
+    int serverWindowBits, clientWindowBits, memLevel;
+    bool incompressible = false;
+    unsigned int samples = 0, skipped = 0;
+    size_t sampledIn = 0, sampledOut = 0;
+
+    // thread pool jobs holding our streams, a closed socket leaves the last one to delete us
+    unsigned int jobs = 0;
+    bool orphaned = false, writeStreamBusy = false;
+
+    // compressed bytes of the message being read, for the expansion limit
+    size_t messageIn = 0;
+    bool tailFed = false;
 
-    PerMessageDeflate(ExtensionsParser &extensionsParser, int options, std::string &response) : readStream({}), writeStream({})
+    // windows can only shrink from what the server is configured with, client_max_window_bits is only answered if offered
+    PerMessageDeflate(ExtensionsParser &extensionsParser, bool forceServerNoContextTakeover, bool forceClientNoContextTakeover, int serverMaxWindowBits, int clientMaxWindowBits, int memLevel, ZlibPool *zlibPool, std::string &response) : zlibPool(zlibPool), memLevel(memLevel)
     {
         response = "Sec-WebSocket-Extensions: permessage-deflate";
-        if ((options & SERVER_NO_CONTEXT_TAKEOVER) || extensionsParser.serverNoContextTakeover) {
+        if (forceServerNoContextTakeover || extensionsParser.serverNoContextTakeover) {
             response += "; server_no_context_takeover";
             serverNoContextTakeover = true;
         }
-        if ((options & CLIENT_NO_CONTEXT_TAKEOVER) || extensionsParser.clientNoContextTakeover) {
+        if (forceClientNoContextTakeover || extensionsParser.clientNoContextTakeover) {
             response += "; client_no_context_takeover";
             clientNoContextTakeover = true;
         }
 
-        inflateInit2(&readStream, -15);
+        serverWindowBits = serverMaxWindowBits;
+        if (extensionsParser.serverMaxWindowBits > 1 && extensionsParser.serverMaxWindowBits < serverWindowBits) {
+            serverWindowBits = extensionsParser.serverMaxWindowBits;
+        }
+        if (serverWindowBits < 15 || extensionsParser.serverMaxWindowBits) {
+            response += "; server_max_window_bits=" + std::to_string(serverWindowBits);
+        }
+
+        clientWindowBits = 15;
+        if (extensionsParser.clientMaxWindowBits) {
+            clientWindowBits = clientMaxWindowBits;
+            if (extensionsParser.clientMaxWindowBits > 1 && extensionsParser.clientMaxWindowBits < clientWindowBits) {
+                clientWindowBits = extensionsParser.clientMaxWindowBits;
+            }
+            if (clientWindowBits < 15) {
+                response += "; client_max_window_bits=" + std::to_string(clientWindowBits);
+            }
+        }
+
+        // frames from Server::compress are only valid here if they never refer back and fit our window
+        sharedWriteStream = serverNoContextTakeover && serverWindowBits == serverMaxWindowBits;
+        initStreams();
+    }
+
+    // the client end of an agreement is the mirror image, server* describes what we write and client* what we read
+    PerMessageDeflate(ExtensionsParser &extensionsParser, int memLevel, ZlibPool *zlibPool) : zlibPool(zlibPool), sharedWriteStream(false), memLevel(memLevel)
+    {
+        serverNoContextTakeover = extensionsParser.clientNoContextTakeover;
+        clientNoContextTakeover = extensionsParser.serverNoContextTakeover;
+        serverWindowBits = extensionsParser.clientMaxWindowBits > 1 ? extensionsParser.clientMaxWindowBits : 15;
+        clientWindowBits = 15;
+        initStreams();
+    }
+
+    void initStreams()
+    {
+        if (!clientNoContextTakeover) {
+            readStream = new z_stream({});
+            inflateInit2(readStream, -clientWindowBits);
+        }
+
+        if (!serverNoContextTakeover) {
+            writeStream = new z_stream({});
+            deflateInit2(writeStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -serverWindowBits, memLevel, Z_DEFAULT_STRATEGY);
+        }
     }
 
     ~PerMessageDeflate()
     {
-        inflateEnd(&readStream);
+        if (clientNoContextTakeover) {
+            releaseReadStream();
+        } else {
+            inflateEnd(readStream);
+            delete readStream;
+        }
+
+        if (serverNoContextTakeover) {
+            releaseWriteStream();
+        } else {
+            deflateEnd(writeStream);
+            delete writeStream;
+        }
+    }
+
+    z_stream *acquireWriteStream() {
+        if (!writeStream) {
+            writeStream = zlibPool->getDeflateStream(serverWindowBits, memLevel);
+        }
+        return writeStream;
+    }
+
+    void releaseWriteStream() {
+        if (serverNoContextTakeover && writeStream) {
+            zlibPool->putDeflateStream(writeStream, serverWindowBits, memLevel);
+            writeStream = nullptr;
+        }
+    }
+
+    // zlib's estimate of 2^windowBits per inflate window and 2^(windowBits + 2) + 2^(memLevel + 9) per deflate context,
+    // plus about 7 and 6 KB of state, the inflate window is only allocated once data arrives
+    size_t memoryUsage() {
+        size_t usage = sizeof(PerMessageDeflate);
+        if (readStream) {
+            usage += sizeof(z_stream) + 7168 + (1 << (clientNoContextTakeover ? 15 : clientWindowBits));
+        }
+        if (writeStream) {
+            usage += sizeof(z_stream) + 6144 + (1 << (serverWindowBits + 2)) + (1 << (memLevel + 9));
+        }
+        return usage;
+    }
+
+    void releaseReadStream() {
+        messageIn = 0;
+        if (clientNoContextTakeover && readStream) {
+            zlibPool->putInflateStream(readStream);
+            readStream = nullptr;
+        }
+    }
+
+    // flushes the whole input, strips the 00 00 ff ff tail on the last fragment and returns 0 on failure
+    static size_t deflate(z_stream *stream, char *src, size_t srcLength, char *dst, size_t dstLength, bool fin, int level = Z_DEFAULT_COMPRESSION) {
+        // the previous message was sync flushed so changing level never emits anything
+        stream->avail_in = 0;
+        stream->next_out = (unsigned char *) dst;
+        stream->avail_out = dstLength;
+        deflateParams(stream, level, Z_DEFAULT_STRATEGY);
+
+        stream->next_in = (unsigned char *) src;
+        stream->avail_in = srcLength;
+        int err = ::deflate(stream, Z_SYNC_FLUSH);
+        if ((err != Z_OK && err != Z_BUF_ERROR) || stream->avail_in || !stream->avail_out) {
+            return 0;
+        }
+
+        // nothing was pending, emit an empty stored block ourselves
+        if (stream->avail_out == dstLength) {
+            if (dstLength < 5) {
+                return 0;
+            }
+            memcpy(dst, "\x00\x00\x00\xff\xff", 5);
+            stream->avail_out -= 5;
+        }
+        // a sync flush always ends in 00 00 ff ff, less than that is no usable output
+        size_t produced = dstLength - stream->avail_out;
+        if (produced < 4) {
+            return 0;
+        }
+        return produced - (fin ? 4 : 0);
+    }
+
+    // same as above into a new[] buffer with headroom free bytes in front, started at a quarter of the input and doubled when full
+    static char *deflate(z_stream *stream, const char *src, size_t srcLength, size_t headroom, size_t &length, bool fin, int level = Z_DEFAULT_COMPRESSION) {
+        size_t capacity = headroom + srcLength / 4 + 64;
+        char *buffer = new char[capacity];
+        stream->avail_in = 0;
+        stream->next_out = (unsigned char *) buffer + headroom;
+        stream->avail_out = capacity - headroom;
+        deflateParams(stream, level, Z_DEFAULT_STRATEGY);
+
+        stream->next_in = (unsigned char *) src;
+        stream->avail_in = srcLength;
+        while (true) {
+            int err = ::deflate(stream, Z_SYNC_FLUSH);
+            if (err != Z_OK && err != Z_BUF_ERROR) {
+                delete [] buffer;
+                return nullptr;
+            }
+            if (stream->avail_out) {
+                break;
+            }
+
+            char *grown = new char[capacity * 2];
+            memcpy(grown + headroom, buffer + headroom, capacity - headroom);
+            delete [] buffer;
+            buffer = grown;
+            stream->next_out = (unsigned char *) buffer + capacity;
+            stream->avail_out = capacity;
+            capacity *= 2;
+        }
+
+        length = capacity - headroom - stream->avail_out;
+        if (!length) {
+            memcpy(buffer + headroom, "\x00\x00\x00\xff\xff", 5);
+            length = 5;
+        }
+        if (fin) {
+            length -= 4;
+        }
+        return buffer;
+    }
+
+    void acquireReadStream() {
+        if (!readStream) {
+            readStream = zlibPool->getInflateStream();
+        }
     }
 
     void setInput(char *src, size_t srcLength) {
-        readStream.next_in = (unsigned char *) src;
-        readStream.avail_in = srcLength;
+        acquireReadStream();
+        readStream->next_in = (unsigned char *) src;
+        readStream->avail_in = srcLength;
+        tailFed = false;
+        messageIn += srcLength;
+    }
+
+    // inflates the input, and the stripped tail on fin, into dst; full means dst ran out with more to come
+    size_t inflate(char *dst, size_t dstLength, bool fin, bool &full) {
+        readStream->next_out = (unsigned char *) dst;
+        readStream->avail_out = dstLength;
+        while (true) {
+            int err = ::inflate(readStream, Z_SYNC_FLUSH);
+            if (err != Z_STREAM_END && err != Z_OK && err != Z_BUF_ERROR) {
+                throw err;
+            }
+            if (!readStream->avail_out || tailFed || !fin) {
+                break;
+            }
+            readStream->next_in = (unsigned char *) "\x00\x00\xff\xff";
+            readStream->avail_in = 4;
+            tailFed = true;
+        }
+        full = !readStream->avail_out;
+        return dstLength - readStream->avail_out;
     }
 
-    size_t inflate(char *dst, size_t dstLength) {
-        if (!readStream.avail_in) {
-            return dstLength;
+    // appends to dst, doubling it as it fills, and throws once it passes maxLength
+    void inflate(std::string &dst, bool fin, size_t maxLength) {
+        bool full = true;
+        while (full) {
+            size_t offset = dst.length(), chunk = std::max<size_t>(offset, 16384);
+            if (maxLength) {
+                chunk = std::min<size_t>(chunk, maxLength + 1 - offset);
+            }
+            dst.resize(offset + chunk);
+            dst.resize(offset + inflate(&dst[offset], chunk, fin, full));
+            if (maxLength && dst.length() > maxLength) {
+                throw Z_DATA_ERROR;
+            }
         }
-        readStream.next_out = (unsigned char *) dst;
-        readStream.avail_out = dstLength;
-        int err = ::inflate(&readStream, Z_NO_FLUSH);
-        if (err != Z_STREAM_END && err != Z_OK) {
-            throw err;
+    }
+
+    // inflates a whole message off the loop, the read stream has to be acquired up front
+    bool inflateMessage(char *src, size_t srcLength, std::string &dst, size_t maxLength) {
+        readStream->next_in = (unsigned char *) src;
+        readStream->avail_in = srcLength;
+        tailFed = false;
+        try {
+            inflate(dst, true, maxLength);
+        } catch (...) {
+            return false;
         }
-        return readStream.avail_out;
+        return true;
     }
 };
 
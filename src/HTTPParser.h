@@ -0,0 +1,183 @@
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <cstring>
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HTTP_SSE2
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace uWS {
+
+struct Header {
+    char *key, *value;
+    unsigned int keyLength, valueLength;
+
+    // lowerKey has to be lowercase, the buffer is never touched
+    bool is(const char *lowerKey, unsigned int length) {
+        if (keyLength != length) {
+            return false;
+        }
+        for (unsigned int i = 0; i < length; i++) {
+            if ((key[i] | 32) != lowerKey[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // whether the comma separated value lists lowerToken, case insensitive
+    bool hasToken(const char *lowerToken, unsigned int length) {
+        for (unsigned int next = 0; next < valueLength; ) {
+            unsigned int start = next, end = next;
+            for (; end < valueLength && value[end] != ','; end++);
+            next = end + 1;
+            for (; start < end && (value[start] == ' ' || value[start] == '\t'); start++);
+            for (; end > start && (value[end - 1] == ' ' || value[end - 1] == '\t'); end--);
+            unsigned int i = 0;
+            for (; end - start == length && i < length && (value[start + i] | 32) == lowerToken[i]; i++);
+            if (end - start == length && i == length) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    explicit operator bool() {
+        return key;
+    }
+};
+
+// non-owning view of a request head, only valid during the callback it is handed to
+struct HTTPRequest {
+    char *method = nullptr, *url = nullptr, *version = nullptr;
+    unsigned int methodLength = 0, urlLength = 0, versionLength = 0;
+    Header *headers = nullptr;
+    unsigned int headerCount = 0;
+
+    Header getHeader(const char *lowerKey, unsigned int length) {
+        for (unsigned int i = 0; i < headerCount; i++) {
+            if (headers[i].is(lowerKey, length)) {
+                return headers[i];
+            }
+        }
+        return {};
+    }
+
+    Header getHeader(const char *lowerKey) {
+        return getHeader(lowerKey, strlen(lowerKey));
+    }
+
+    // the url without its query
+    unsigned int getPathLength() {
+        char *query = (char *) memchr(url, '?', urlLength);
+        return query ? query - url : urlLength;
+    }
+};
+
+// finds the end of a request head in place, resuming where the previous call stopped
+class HTTPParser {
+    size_t scanned = 0;
+
+    static inline unsigned int lowestBit(unsigned int mask) {
+#ifdef _MSC_VER
+        unsigned long bit;
+        _BitScanForward(&bit, mask);
+        return bit;
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+public:
+    static const unsigned int MAX_HEADERS = 64;
+
+    // returns the length of the head including the blank line, 0 while incomplete
+    size_t consume(const char *data, size_t length) {
+        size_t i = scanned;
+
+#ifdef HTTP_SSE2
+        // 16 bytes at a time, only carriage returns are looked at closer
+        const __m128i cr = _mm_set1_epi8('\r');
+        for (; i + 16 <= length; i += 16) {
+            unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (data + i)), cr));
+            for (; mask; mask &= mask - 1) {
+                size_t j = i + lowestBit(mask);
+                if (j + 4 > length) {
+                    scanned = j;
+                    return 0;
+                }
+                if (!memcmp(data + j, "\r\n\r\n", 4)) {
+                    return j + 4;
+                }
+            }
+        }
+#endif
+
+        for (const char *cr; (cr = (const char *) memchr(data + i, '\r', length - i)); i++) {
+            i = cr - data;
+            if (i + 4 > length) {
+                scanned = i;
+                return 0;
+            }
+            if (!memcmp(cr, "\r\n\r\n", 4)) {
+                return i + 4;
+            }
+        }
+        scanned = length;
+        return 0;
+    }
+
+    // splits a complete head into at most MAX_HEADERS headers after the request line, values without surrounding whitespace
+    static unsigned int parseHeaders(char *head, size_t length, Header *headers) {
+        char *end = head + length - 2;
+        char *cursor = (char *) memchr(head, '\n', length) + 1;
+        unsigned int count = 0;
+        while (cursor < end && count < MAX_HEADERS) {
+            char *lineEnd = (char *) memchr(cursor, '\n', end + 2 - cursor);
+            char *valueEnd = lineEnd[-1] == '\r' ? lineEnd - 1 : lineEnd;
+            char *colon = (char *) memchr(cursor, ':', valueEnd - cursor);
+            if (colon) {
+                char *value = colon + 1;
+                for (; value < valueEnd && (*value == ' ' || *value == '\t'); value++);
+                for (; valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'); valueEnd--);
+                headers[count++] = {cursor, value, (unsigned int) (colon - cursor), (unsigned int) (valueEnd - value)};
+            }
+            cursor = lineEnd + 1;
+        }
+        return count;
+    }
+
+    // points the request at its method, url, version and headers, nothing is copied
+    static void parse(char *head, size_t length, HTTPRequest &request, Header *headers) {
+        char *lineEnd = (char *) memchr(head, '\r', length);
+        char *space = (char *) memchr(head, ' ', lineEnd - head);
+        if (space) {
+            request.method = head;
+            request.methodLength = space - head;
+            request.url = space + 1;
+            space = (char *) memchr(request.url, ' ', lineEnd - request.url);
+            request.urlLength = (space ? space : lineEnd) - request.url;
+            request.version = space ? space + 1 : lineEnd;
+            request.versionLength = lineEnd - request.version;
+        } else {
+            request.method = request.url = request.version = lineEnd;
+        }
+        request.headers = headers;
+        request.headerCount = parseHeaders(head, length, headers);
+    }
+
+    void reset() {
+        scanned = 0;
+    }
+};
+
+}
+
+#endif // HTTPPARSER_H
@@ -0,0 +1,30 @@
+#ifndef HTTPRESPONSE_H
+#define HTTPRESPONSE_H
+
+#include "WebSocket.h"
+
+namespace uWS {
+
+class HTTPSocket;
+
+class WIN32_EXPORT HTTPResponse
+{
+    friend class HTTPSocket;
+    HTTPSocket *httpSocket;
+    HTTPResponse(HTTPSocket *httpSocket) : httpSocket(httpSocket) {}
+public:
+    HTTPResponse() : httpSocket(nullptr) {}
+
+    // data is the whole response, status line and headers included; pipelined requests wait until it is ended
+    void end(const char *data, size_t length);
+    void end(WebSocket::PreparedMessage *preparedResponse);
+    void close();
+    void *getData();
+    void setData(void *data);
+    static WebSocket::PreparedMessage *prepareResponse(const char *data, size_t length);
+    bool operator==(const HTTPResponse &other) const {return httpSocket == other.httpSocket;}
+};
+
+}
+
+#endif // HTTPRESPONSE_H
@@ -1,6 +1,7 @@
 #include "HTTPSocket.h"
 #include "Server.h"
 #include "Network.h"
+#include "StaticFiles.h"
 
 #include <iostream>
 #include <utility>
@@ -8,53 +9,29 @@
 #include <uv.h>
 #include <openssl/ssl.h>
 
-struct Request {
-    char *cursor;
-    std::pair<char *, size_t> key, value;
-    Request(char *cursor) : cursor(cursor)
-    {
-        size_t length;
-        for (; isspace(*cursor); cursor++);
-        for (length = 0; !isspace(cursor[length]) && cursor[length] != '\r'; length++);
-        key = {cursor, length};
-        cursor += length + 1;
-        for (length = 0; !isspace(cursor[length]) && cursor[length] != '\r'; length++);
-        value = {cursor, length};
-    }
-    Request &operator++(int)
-    {
-        size_t length = 0;
-        for (; !(cursor[0] == '\r' && cursor[1] == '\n'); cursor++);
-        cursor += 2;
-        if (cursor[0] == '\r' && cursor[1] == '\n') {
-            key = value = {0, 0};
-        } else {
-            for (; cursor[length] != ':' && cursor[length] != '\r'; length++);
-            key = {cursor, length};
-            if (cursor[length] != '\r') {
-                cursor += length;
-                length = 0;
-                while (isspace(*(++cursor)));
-                for (; cursor[length] != '\r'; length++);
-                value = {cursor, length};
-            } else {
-                value = {0, 0};
-            }
-        }
-        return *this;
-    }
-};
+#ifdef __linux
+#include <sys/sendfile.h>
+#endif
 
 namespace uWS {
 
 HTTPSocket::HTTPSocket(uv_poll_t *p, Server *server, void *ssl) : p(p), server(server), ssl(ssl)
 {
-    uv_poll_start(p, UV_READABLE, onReadable);
+#ifdef SSL_OP_ENABLE_KTLS
+    // has to be set before the handshake, the kernel takes over the record layer when it completes
+    if (ssl && (server->options & KERNEL_TLS)) {
+        SSL_set_options((SSL *) ssl, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+
+    // TLS starts with its own handshake phase, nothing is read before it completes
+    handshakeStart = uv_hrtime();
+    uv_poll_start(p, UV_READABLE, ssl ? onHandshake : onReadable);
     p->data = this;
 
     t = new uv_timer_t;
     uv_timer_init(server->loop, t);
-    uv_timer_start(t, onTimeout, 15000, 0);
+    uv_timer_start(t, onTimeout, TIMEOUT, 0);
     t->data = this;
 }
 
@@ -79,25 +56,93 @@ uv_os_sock_t HTTPSocket::stop()
 void HTTPSocket::close(uv_os_sock_t fd)
 {
     if (ssl) {
+        SSL_set_shutdown((SSL *) ssl, SSL_SENT_SHUTDOWN);
         SSL_free((SSL *) ssl);
     }
     ::close(fd);
 }
 
+// closes the connection and cancels anything queued, we are deleted right away unless process() is running
+void HTTPSocket::terminate()
+{
+    if (closed) {
+        return;
+    }
+    closed = true;
+
+    if (file) {
+        file->release();
+        file = nullptr;
+    } else if (awaiting) {
+        server->httpDisconnectionCallback(HTTPResponse(this));
+    }
+
+    while (!messageQueue.empty()) {
+        SocketData::Queue::Message *message = messageQueue.front();
+        if (message->callback) {
+            message->callback(nullptr, message->callbackData, true);
+        }
+        messageQueue.pop();
+    }
+
+    close(stop());
+    if (!processing) {
+        delete this;
+    }
+}
+
 void HTTPSocket::onTimeout(uv_timer_t *t)
 {
-    HTTPSocket *httpData = (HTTPSocket *) t->data;
-    httpData->close(httpData->stop());
-    delete httpData;
+    HTTPSocket *httpSocket = (HTTPSocket *) t->data;
+    if (!httpSocket->answered) {
+        httpSocket->server->metrics.handshakeTimeouts.add();
+    }
+    httpSocket->terminate();
+}
+
+// polls for whichever direction OpenSSL is waiting on until the handshake is done
+void HTTPSocket::onHandshake(uv_poll_t *p, int status, int events)
+{
+    HTTPSocket *httpData = (HTTPSocket *) p->data;
+    httpData->server->es.event();
+    if (status < 0) {
+        httpData->terminate();
+        return;
+    }
+
+    int result = SSL_do_handshake((SSL *) httpData->ssl);
+    if (result != 1) {
+        switch (SSL_get_error((SSL *) httpData->ssl, result)) {
+        case SSL_ERROR_WANT_READ:
+            uv_poll_start(p, UV_READABLE, onHandshake);
+            break;
+        case SSL_ERROR_WANT_WRITE:
+            uv_poll_start(p, UV_WRITABLE, onHandshake);
+            break;
+        default:
+            httpData->terminate();
+        }
+        return;
+    }
+
+    if (httpData->server->handshakeCallback) {
+        httpData->server->handshakeCallback(uv_hrtime() - httpData->handshakeStart, SSL_session_reused((SSL *) httpData->ssl));
+    }
+
+    // the request may have come along with the last handshake flight and already sit in OpenSSL
+    uv_poll_start(p, UV_READABLE, onReadable);
+    if (SSL_has_pending((SSL *) httpData->ssl)) {
+        onReadable(p, 0, UV_READABLE);
+    }
 }
 
 void HTTPSocket::onReadable(uv_poll_t *p, int status, int events)
 {
     HTTPSocket *httpData = (HTTPSocket *) p->data;
+    httpData->server->es.event();
 
     if (status < 0) {
-        httpData->close(httpData->stop());
-        delete httpData;
+        httpData->terminate();
         return;
     }
 
@@ -118,49 +163,361 @@ void HTTPSocket::onReadable(uv_poll_t *p, int status, int events)
         length = recv(fd, httpData->server->recvBuffer, Server::LARGE_BUFFER_SIZE, 0);
     }
 
-    if (length == SOCKET_ERROR || length == 0 || httpData->headerBuffer.length() + length > MAX_HEADER_BUFFER_LENGTH) {
-        int fd = httpData->stop();
-        httpData->close(fd);
-        delete httpData;
+    // while a response is outstanding pipelined requests are only buffered, a head and at most one receive buffer behind it
+    // since that is what an upgrade among them hands on to the WebSocket
+    if (length == SOCKET_ERROR || length == 0 || ((httpData->awaiting || httpData->upgradePending) && httpData->headerBuffer.length() + length > MAX_HEADER_BUFFER_LENGTH + Server::LARGE_BUFFER_SIZE)) {
+        httpData->terminate();
         return;
     }
 
-    httpData->headerBuffer.append(httpData->server->recvBuffer, length);
-    if (httpData->headerBuffer.find("\r\n\r\n") != std::string::npos) {
+    // cork pipelined responses into one large package
+#ifdef __linux
+    int cork = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(int));
+#endif
+
+    // a request that arrives in one read is parsed right in the receive buffer
+    if (httpData->headerBuffer.length()) {
+        httpData->headerBuffer.append(httpData->server->recvBuffer, length);
+        httpData->process((char *) httpData->headerBuffer.data(), httpData->headerBuffer.length());
+    } else {
+        httpData->process(httpData->server->recvBuffer, length);
+    }
+
+#ifdef __linux
+    if (!uv_is_closing((uv_handle_t *) p)) {
+        cork = 0;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(int));
+    }
+#endif
+}
+
+// hands out complete requests in order, one at a time, and keeps whatever is left for later
+void HTTPSocket::process(char *data, size_t length)
+{
+    size_t offset = 0;
+    processing = true;
+    while (!awaiting && !closed) {
+        char *head = data + offset;
+        size_t headLength = parser.consume(head, length - offset);
+        if (!headLength) {
+            if (length - offset > MAX_HEADER_BUFFER_LENGTH) {
+                terminate();
+            }
+            break;
+        }
+
+        // the request line and headers are only pointed at, never copied
+        HTTPRequest request;
+        Header headers[HTTPParser::MAX_HEADERS];
+        HTTPParser::parse(head, headLength, request, headers);
+        Header secKey = request.getHeader("sec-websocket-key", 17);
+
+        // this is an upgrade, the socket leaves us once everything answered before it is sent
+        if (secKey) {
+            if (secKey.valueLength != 24) {
+                terminate();
+                break;
+            }
+            upgradePending = !messageQueue.empty();
+            if (upgradePending) {
+                parser.reset();
+                break;
+            }
+
+            uv_os_sock_t fd = stop();
+            closed = true;
+#ifdef __linux
+            // onReadable only uncorks sockets it still polls, the 101 would otherwise wait for the cork timeout
+            int cork = 0;
+            setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(int));
+#endif
+            Header extensions = request.getHeader("sec-websocket-extensions", 24);
+            const char *buffered = head + headLength;
+            size_t bufferedLength = length - offset - headLength;
+            if (Server *target = server->match(request)) {
+                target->upgrade(fd, secKey.value, ssl, extensions.value, extensions.valueLength, buffered, bufferedLength);
+            } else if (server->upgradeCallback) {
+                server->upgradeCallback(fd, secKey.value, ssl, extensions.value, extensions.valueLength, buffered, bufferedLength, request);
+            } else {
+                server->upgrade(fd, secKey.value, ssl, extensions.value, extensions.valueLength, buffered, bufferedLength);
+            }
+            break;
+        }
+
+        // without a handler we do not handle any HTTP-only requests besides static files and metrics
+        StaticFiles *staticFiles = server->matchStatic(request);
+        bool metrics = !staticFiles && server->matchMetrics(request);
+        if (!staticFiles && !metrics && !server->httpRequestCallback) {
+            terminate();
+            break;
+        }
+
+        Header contentLength = request.getHeader("content-length", 14);
+        size_t bodyLength = 0;
+        bool validLength = true;
+        for (unsigned int i = 0; contentLength && i < contentLength.valueLength; i++) {
+            validLength &= contentLength.value[i] >= '0' && contentLength.value[i] <= '9' && i < 19;
+            bodyLength = bodyLength * 10 + contentLength.value[i] - '0';
+        }
+
+        // chunked request bodies are not supported
+        if (!validLength || request.getHeader("transfer-encoding", 17) || (server->maxPayload && bodyLength > server->maxPayload)) {
+            terminate();
+            break;
+        }
+
+        if (length - offset - headLength < bodyLength) {
+            break;
+        }
+
+        // HTTP/1.1 stays open unless told otherwise, HTTP/1.0 only when asked to
+        Header connection = request.getHeader("connection", 10);
+        keepAlive = request.versionLength == 8 && !memcmp(request.version, "HTTP/1.", 7) && request.version[7] >= '1' && request.version[7] <= '9';
+        if (connection && connection.hasToken("close", 5)) {
+            keepAlive = false;
+        } else if (connection && connection.hasToken("keep-alive", 10)) {
+            keepAlive = true;
+        }
+
+        awaiting = true;
+        uv_timer_stop(t);
+        offset += headLength + bodyLength;
+        parser.reset();
+        if (staticFiles) {
+            serveStatic(staticFiles, request);
+        } else if (metrics) {
+            std::string response = server->metricsResponse();
+            write((char *) response.data(), response.length(), false, nullptr, nullptr);
+            ended();
+        } else {
+            server->httpRequestCallback(HTTPResponse(this), request, head + headLength, bodyLength);
+        }
+    }
+    processing = false;
+
+    if (closed) {
+        delete this;
+    } else if (data == server->recvBuffer) {
+        headerBuffer.assign(data + offset, length - offset);
+    } else {
+        headerBuffer.erase(0, offset);
+    }
+}
+
+// responses go through the same queue as WebSocket messages
+void HTTPSocket::write(char *data, size_t length, bool preparedMessage, void (*callback)(WebSocket webSocket, void *data, bool cancelled), void *callbackData)
+{
+    if (WebSocket::queueWrite(p, kernelSend((SSL *) ssl) ? nullptr : ssl, &messageQueue, data, length, false, callback, callbackData, preparedMessage)) {
+        uv_poll_start(p, UV_WRITABLE | UV_READABLE, onWritableReadable);
+    }
+}
+
+void HTTPSocket::onWritableReadable(uv_poll_t *p, int status, int events)
+{
+    // onReadable counts itself
+    if (!(events & UV_READABLE)) {
+        ((HTTPSocket *) p->data)->server->es.event();
+    }
 
-        // stop poll and timer
-        uv_os_sock_t fd = httpData->stop();
+    if (status < 0) {
+        ((HTTPSocket *) p->data)->terminate();
+        return;
+    }
 
-        // parse secKey, extensions
-        Request h = (char *) httpData->headerBuffer.data();
-        std::pair<char *, size_t> secKey = {}, extensions = {};
-        for (h++; h.key.second; h++) {
-            if (h.key.second == 17 || h.key.second == 24) {
-                // lowercase the key
-                for (size_t i = 0; i < h.key.second; i++) {
-                    h.key.first[i] = tolower(h.key.first[i]);
+    if (events & UV_READABLE) {
+        onReadable(p, status, events);
+        if (uv_is_closing((uv_handle_t *) p) || !(events & UV_WRITABLE)) {
+            return;
+        }
+    }
+
+    HTTPSocket *httpData = (HTTPSocket *) p->data;
+    if (httpData->messageQueue.empty() || WebSocket::flushQueue(p, kernelSend((SSL *) httpData->ssl) ? nullptr : httpData->ssl, &httpData->messageQueue)) {
+        if (httpData->file) {
+            if (!httpData->messageQueue.empty()) {
+                httpData->terminate();
+            } else if (httpData->sendFile()) {
+                if (httpData->messageQueue.empty()) {
+                    uv_poll_start(p, UV_READABLE, onReadable);
                 }
-                if (!strncmp(h.key.first, "sec-websocket-key", h.key.second)) {
-                    secKey = h.value;
-                } else if (!strncmp(h.key.first, "sec-websocket-extensions", h.key.second)) {
-                    extensions = h.value;
+                httpData->ended();
+            }
+            return;
+        }
+
+        uv_poll_start(p, UV_READABLE, onReadable);
+        if (httpData->closeAfterFlush && httpData->messageQueue.empty()) {
+            httpData->terminate();
+        } else if (httpData->upgradePending && httpData->messageQueue.empty()) {
+            httpData->process((char *) httpData->headerBuffer.data(), httpData->headerBuffer.length());
+        }
+    }
+}
+
+// cached headers go out through the queue, small files as one prebuilt response and larger ones with sendfile behind them
+void HTTPSocket::serveStatic(StaticFiles *staticFiles, HTTPRequest &request)
+{
+    Asset *asset = staticFiles->get(request, uv_now(server->loop));
+    if (!asset) {
+        static const char notFound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        write((char *) notFound, sizeof(notFound) - 1, false, nullptr, nullptr);
+        ended();
+        return;
+    }
+
+    Header acceptEncoding = request.getHeader("accept-encoding", 15);
+    if (asset->gzip && acceptEncoding && StaticFiles::acceptsGzip(acceptEncoding.value, acceptEncoding.valueLength)) {
+        asset = asset->gzip;
+    }
+
+    Header ifNoneMatch = request.getHeader("if-none-match", 13);
+    if (ifNoneMatch && ifNoneMatch.valueLength == asset->etag.length() && !memcmp(ifNoneMatch.value, asset->etag.data(), ifNoneMatch.valueLength)) {
+        std::string notModified = "HTTP/1.1 304 Not Modified\r\nETag: " + asset->etag + "\r\n\r\n";
+        write((char *) notModified.data(), notModified.length(), false, nullptr, nullptr);
+        ended();
+        return;
+    }
+
+    if (request.methodLength == 4) {
+        write((char *) asset->headers.data(), asset->headers.length(), false, nullptr, nullptr);
+        ended();
+        return;
+    }
+
+    asset->references++;
+    if (asset->response) {
+        write(asset->response, asset->responseLength, true, [](WebSocket webSocket, void *data, bool cancelled) {
+            ((Asset *) data)->release();
+        }, asset);
+        ended();
+        return;
+    }
+
+    write((char *) asset->headers.data(), asset->headers.length(), false, nullptr, nullptr);
+    file = asset;
+    fileOffset = 0;
+    fileRemaining = asset->size;
+    if (!closed && messageQueue.empty() && sendFile()) {
+        ended();
+    }
+}
+
+// continues the body of the current file, true once all of it is sent
+bool HTTPSocket::sendFile()
+{
+    uv_os_sock_t fd;
+    uv_fileno((uv_handle_t *) p, (uv_os_fd_t *) &fd);
+
+    while (fileRemaining) {
+        ssize_t sent;
+#ifdef __linux
+        // plaintext and kernel TLS go from the page cache to the socket without passing through us
+        if (!ssl || kernelSend((SSL *) ssl)) {
+            sent = sendfile(fd, file->fd, &fileOffset, fileRemaining);
+        } else
+#endif
+        {
+            // TLS has to see the bytes, one chunk at a time through the queue
+            char chunk[16384];
+            sent = pread(file->fd, chunk, std::min<size_t>(fileRemaining, sizeof(chunk)), fileOffset);
+            if (sent > 0) {
+                fileOffset += sent;
+                write(chunk, sent, false, nullptr, nullptr);
+                if (closed) {
+                    return false;
                 }
             }
         }
 
-        // this is an upgrade
-        if (secKey.first && secKey.second == 24) {
-            if (httpData->server->upgradeCallback) {
-                httpData->server->upgradeCallback(fd, secKey.first, httpData->ssl, extensions.first, extensions.second);
+        if (sent <= 0) {
+            if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                uv_poll_start(p, UV_WRITABLE | UV_READABLE, onWritableReadable);
             } else {
-                httpData->server->upgrade(fd, secKey.first, httpData->ssl, extensions.first, extensions.second);
+                terminate();
+            }
+            return false;
+        }
+
+        fileRemaining -= sent;
+        if (!messageQueue.empty()) {
+            if (!fileRemaining) {
+                break;
             }
+            return false;
+        }
+    }
+
+    file->release();
+    file = nullptr;
+    return true;
+}
+
+// the current request is answered, the idle timer runs again and pipelined requests continue
+void HTTPSocket::ended()
+{
+    awaiting = false;
+    answered = true;
+    if (!keepAlive) {
+        if (messageQueue.empty()) {
+            terminate();
         } else {
-            // we do not handle any HTTP-only requests
-            httpData->close(fd);
+            closeAfterFlush = true;
         }
-        delete httpData;
+        return;
+    }
+
+    uv_timer_start(t, onTimeout, TIMEOUT, 0);
+    if (!processing && headerBuffer.length()) {
+        process((char *) headerBuffer.data(), headerBuffer.length());
     }
 }
 
+void HTTPResponse::end(const char *data, size_t length)
+{
+    if (httpSocket->closed || !httpSocket->awaiting) {
+        return;
+    }
+    httpSocket->write((char *) data, length, false, nullptr, nullptr);
+    httpSocket->ended();
+}
+
+// the prepared response is only referenced, never copied
+void HTTPResponse::end(WebSocket::PreparedMessage *preparedResponse)
+{
+    if (httpSocket->closed || !httpSocket->awaiting) {
+        return;
+    }
+    preparedResponse->references++;
+    httpSocket->write(preparedResponse->buffer, preparedResponse->length, true, [](WebSocket webSocket, void *data, bool cancelled) {
+        WebSocket::finalizeMessage((WebSocket::PreparedMessage *) data);
+    }, preparedResponse);
+    httpSocket->ended();
+}
+
+void HTTPResponse::close()
+{
+    httpSocket->terminate();
+}
+
+void *HTTPResponse::getData()
+{
+    return httpSocket->data;
+}
+
+void HTTPResponse::setData(void *data)
+{
+    httpSocket->data = data;
+}
+
+WebSocket::PreparedMessage *HTTPResponse::prepareResponse(const char *data, size_t length)
+{
+    WebSocket::PreparedMessage *preparedResponse = new WebSocket::PreparedMessage;
+    preparedResponse->buffer = new char[sizeof(SocketData::Queue::Message) + length] + sizeof(SocketData::Queue::Message);
+    memcpy(preparedResponse->buffer, data, length);
+    preparedResponse->length = length;
+    preparedResponse->references = 1;
+    return preparedResponse;
+}
+
 }
@@ -2,28 +2,59 @@
 #define HTTPSOCKET_H
 
 #include <string>
-#include <vector>
 #include <uv.h>
+#include "HTTPParser.h"
+#include "HTTPResponse.h"
+#include "SocketData.h"
 
 namespace uWS {
 
 class Server;
+class StaticFiles;
+struct Asset;
 
 class HTTPSocket {
     friend class Server;
+    friend class HTTPResponse;
     std::string headerBuffer;
-    std::vector<std::pair<char *, size_t>> headers;
+    HTTPParser parser;
     static const int MAX_HEADER_BUFFER_LENGTH = 10240;
+    static const int TIMEOUT = 15000;
 
     uv_poll_t *p;
     uv_timer_t *t;
     Server *server;
     void *ssl;
+    void *data = nullptr;
+    SocketData::Queue messageQueue;
+
+    // a request was handed out and is not ended yet
+    bool awaiting = false;
+    bool keepAlive = false, closeAfterFlush = false;
+    // a request was answered, timeouts after that are idle keep-alive ones and not counted as handshake timeouts
+    bool answered = false;
+    bool processing = false, closed = false;
+    // a pipelined upgrade waits in headerBuffer until the responses queued before it are sent
+    bool upgradePending = false;
+    uint64_t handshakeStart;
+
+    // body of a static file still being sent, the request stays awaiting until it is done
+    Asset *file = nullptr;
+    off_t fileOffset = 0;
+    size_t fileRemaining = 0;
 
     HTTPSocket(uv_poll_t *p, Server *server, void *ssl);
     uv_os_sock_t stop();
     void close(uv_os_sock_t fd);
+    void terminate();
+    void process(char *data, size_t length);
+    void write(char *data, size_t length, bool preparedMessage, void (*callback)(WebSocket webSocket, void *data, bool cancelled), void *callbackData);
+    void ended();
+    void serveStatic(StaticFiles *staticFiles, HTTPRequest &request);
+    bool sendFile();
+    static void onHandshake(uv_poll_t *p, int status, int events);
     static void onReadable(uv_poll_t *p, int status, int events);
+    static void onWritableReadable(uv_poll_t *p, int status, int events);
     static void onTimeout(uv_timer_t *t);
 };
 
@@ -0,0 +1,164 @@
+#include "Metrics.h"
+
+#include <cstdio>
+
+namespace uWS {
+
+MetricsSnapshot::Histogram::Histogram(const MetricsHistogram &histogram)
+{
+    for (int i = 0; i < MetricsHistogram::BUCKETS; i++) {
+        buckets[i] = histogram.buckets[i].get();
+    }
+    count = histogram.count.get();
+    sum = histogram.sum.get();
+}
+
+MetricsSnapshot Metrics::snapshot() const
+{
+    MetricsSnapshot snapshot;
+    snapshot.connections = connections.get();
+    snapshot.upgrades = upgrades.get();
+    snapshot.handshakeTimeouts = handshakeTimeouts.get();
+    snapshot.queuedBytes = queuedBytes.get();
+    for (int i = 0; i < 16; i++) {
+        snapshot.messagesIn[i] = messagesIn[i].get();
+        snapshot.bytesIn[i] = bytesIn[i].get();
+        snapshot.messagesOut[i] = messagesOut[i].get();
+        snapshot.bytesOut[i] = bytesOut[i].get();
+    }
+    snapshot.deflateIn = deflateIn.get();
+    snapshot.deflateOut = deflateOut.get();
+    snapshot.inflateIn = inflateIn.get();
+    snapshot.inflateOut = inflateOut.get();
+    for (int i = 0; i < 17; i++) {
+        snapshot.forcedCloses[i] = forcedCloses[i].get();
+    }
+    snapshot.messageSize = messageSize;
+    snapshot.callbackTime = callbackTime;
+    return snapshot;
+}
+
+static void add(MetricsSnapshot::Histogram &histogram, const MetricsSnapshot::Histogram &other)
+{
+    for (int i = 0; i < MetricsHistogram::BUCKETS; i++) {
+        histogram.buckets[i] += other.buckets[i];
+    }
+    histogram.count += other.count;
+    histogram.sum += other.sum;
+}
+
+MetricsSnapshot &MetricsSnapshot::operator+=(const MetricsSnapshot &other)
+{
+    connections += other.connections;
+    upgrades += other.upgrades;
+    handshakeTimeouts += other.handshakeTimeouts;
+    queuedBytes += other.queuedBytes;
+    for (int i = 0; i < 16; i++) {
+        messagesIn[i] += other.messagesIn[i];
+        bytesIn[i] += other.bytesIn[i];
+        messagesOut[i] += other.messagesOut[i];
+        bytesOut[i] += other.bytesOut[i];
+    }
+    deflateIn += other.deflateIn;
+    deflateOut += other.deflateOut;
+    inflateIn += other.inflateIn;
+    inflateOut += other.inflateOut;
+    for (int i = 0; i < 17; i++) {
+        forcedCloses[i] += other.forcedCloses[i];
+    }
+    add(messageSize, other.messageSize);
+    add(callbackTime, other.callbackTime);
+    return *this;
+}
+
+static void metric(std::string &out, const std::string &name, const char *type, const char *help)
+{
+    out += "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+static void sample(std::string &out, const std::string &name, const char *labels, double value)
+{
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %.15g\n", name.c_str(), labels, value);
+    out += line;
+}
+
+// cumulative buckets up to 2^i times scale, empty ones at the top are left out
+static void histogram(std::string &out, const std::string &name, const char *help, const MetricsSnapshot::Histogram &histogram, double scale)
+{
+    metric(out, name, "histogram", help);
+    int last = MetricsHistogram::BUCKETS - 1;
+    while (last && !histogram.buckets[last]) {
+        last--;
+    }
+
+    unsigned long long cumulative = 0;
+    char labels[64];
+    for (int i = 0; i <= last && i < MetricsHistogram::BUCKETS - 1; i++) {
+        cumulative += histogram.buckets[i];
+        snprintf(labels, sizeof(labels), "{le=\"%.9g\"}", (double) (1ull << i) * scale);
+        sample(out, name + "_bucket", labels, cumulative);
+    }
+    sample(out, name + "_bucket", "{le=\"+Inf\"}", histogram.count);
+    sample(out, name + "_sum", "", histogram.sum * scale);
+    sample(out, name + "_count", "", histogram.count);
+}
+
+std::string MetricsSnapshot::prometheus(const std::string &prefix) const
+{
+    static const struct {
+        int opCode;
+        const char *label;
+    } opCodes[] = {{0, "{opcode=\"continuation\"}"}, {TEXT, "{opcode=\"text\"}"}, {BINARY, "{opcode=\"binary\"}"},
+                   {CLOSE, "{opcode=\"close\"}"}, {PING, "{opcode=\"ping\"}"}, {PONG, "{opcode=\"pong\"}"}};
+
+    std::string out;
+    metric(out, prefix + "_connections", "gauge", "Open WebSocket connections.");
+    sample(out, prefix + "_connections", "", connections);
+    metric(out, prefix + "_upgrades_total", "counter", "Connections upgraded to WebSocket.");
+    sample(out, prefix + "_upgrades_total", "", upgrades);
+    metric(out, prefix + "_handshake_timeouts_total", "counter", "HTTP and TLS connections that timed out before upgrading.");
+    sample(out, prefix + "_handshake_timeouts_total", "", handshakeTimeouts);
+    metric(out, prefix + "_queued_bytes", "gauge", "Bytes waiting in send queues.");
+    sample(out, prefix + "_queued_bytes", "", queuedBytes);
+
+    const struct {
+        const char *name, *help;
+        const unsigned long long *values;
+    } byOpCode[] = {{"_messages_received_total", "Messages received by opcode.", messagesIn},
+                    {"_received_bytes_total", "Payload bytes received by opcode, after inflating.", bytesIn},
+                    {"_messages_sent_total", "Messages sent by opcode.", messagesOut},
+                    {"_sent_bytes_total", "Payload bytes sent by opcode, before deflating.", bytesOut}};
+    for (auto &counter : byOpCode) {
+        metric(out, prefix + counter.name, "counter", counter.help);
+        for (auto &opCode : opCodes) {
+            sample(out, prefix + counter.name, opCode.label, counter.values[opCode.opCode]);
+        }
+    }
+
+    metric(out, prefix + "_deflate_bytes_total", "counter", "Bytes into and out of permessage-deflate compression.");
+    sample(out, prefix + "_deflate_bytes_total", "{stage=\"in\"}", deflateIn);
+    sample(out, prefix + "_deflate_bytes_total", "{stage=\"out\"}", deflateOut);
+    metric(out, prefix + "_inflate_bytes_total", "counter", "Bytes into and out of permessage-deflate decompression.");
+    sample(out, prefix + "_inflate_bytes_total", "{stage=\"in\"}", inflateIn);
+    sample(out, prefix + "_inflate_bytes_total", "{stage=\"out\"}", inflateOut);
+    metric(out, prefix + "_compression_ratio", "gauge", "Compressed over uncompressed bytes so far.");
+    sample(out, prefix + "_compression_ratio", "{direction=\"sent\"}", deflateIn ? (double) deflateOut / deflateIn : 1);
+    sample(out, prefix + "_compression_ratio", "{direction=\"received\"}", inflateOut ? (double) inflateIn / inflateOut : 1);
+
+    metric(out, prefix + "_forced_closes_total", "counter", "Connections closed without a closing handshake by close code.");
+    char labels[32];
+    for (int i = 0; i < 16; i++) {
+        if (forcedCloses[i]) {
+            snprintf(labels, sizeof(labels), "{code=\"%d\"}", 1000 + i);
+            sample(out, prefix + "_forced_closes_total", labels, forcedCloses[i]);
+        }
+    }
+    sample(out, prefix + "_forced_closes_total", "{code=\"other\"}", forcedCloses[16]);
+
+    histogram(out, prefix + "_message_size_bytes", "Payload bytes of text and binary messages in both directions.", messageSize, 1);
+    histogram(out, prefix + "_callback_duration_seconds", "Time spent in the message callback.", callbackTime, 1e-9);
+    return out;
+}
+
+}
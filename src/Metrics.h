@@ -0,0 +1,118 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include "WebSocket.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace uWS {
+
+// only the loop owning it writes, so adding is a plain load and store and other threads still never read a torn value
+// (a send from another thread may lose an update, never corrupt one)
+struct Counter {
+    std::atomic<unsigned long long> value;
+    Counter() : value(0) {}
+
+    void add(unsigned long long n = 1) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void subtract(unsigned long long n = 1) {
+        value.store(value.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
+
+    unsigned long long get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+// bucket i counts values up to 2^i, the last one everything larger
+struct MetricsHistogram {
+    static const int BUCKETS = 40;
+    Counter buckets[BUCKETS], count, sum;
+
+    static int bucket(unsigned long long value) {
+        if (value < 2) {
+            return 0;
+        }
+#ifdef _MSC_VER
+        unsigned long bit;
+        _BitScanReverse64(&bit, value - 1);
+        return bit + 1;
+#else
+        return 64 - __builtin_clzll(value - 1);
+#endif
+    }
+
+    void record(unsigned long long value) {
+        int bucket = MetricsHistogram::bucket(value);
+        buckets[bucket < BUCKETS ? bucket : BUCKETS - 1].add();
+        count.add();
+        sum.add(value);
+    }
+};
+
+// plain numbers of one or more servers at one point in time
+struct MetricsSnapshot {
+    struct Histogram {
+        unsigned long long buckets[MetricsHistogram::BUCKETS] = {}, count = 0, sum = 0;
+        Histogram() = default;
+        Histogram(const MetricsHistogram &histogram);
+    };
+
+    unsigned long long connections = 0, upgrades = 0, handshakeTimeouts = 0, queuedBytes = 0;
+    unsigned long long messagesIn[16] = {}, bytesIn[16] = {}, messagesOut[16] = {}, bytesOut[16] = {};
+    unsigned long long deflateIn = 0, deflateOut = 0, inflateIn = 0, inflateOut = 0;
+    unsigned long long forcedCloses[17] = {};
+    Histogram messageSize, callbackTime;
+
+    MetricsSnapshot &operator+=(const MetricsSnapshot &other);
+    // the Prometheus text format, every name starting with prefix
+    std::string prometheus(const std::string &prefix = "uws") const;
+};
+
+// everything a server counts, on its own loop
+struct Metrics {
+    // open WebSockets and how many ever upgraded, HTTP sockets that timed out before upgrading
+    Counter connections, upgrades, handshakeTimeouts;
+    // by opcode, payloads as the application hands them over or gets them
+    Counter messagesIn[16], bytesIn[16], messagesOut[16], bytesOut[16];
+    // permessage-deflate, bytes before and after
+    Counter deflateIn, deflateOut, inflateIn, inflateOut;
+    // bytes waiting in send queues for the socket to become writable
+    Counter queuedBytes;
+    // closes without a closing handshake by code, 1000 to 1015 and then everything else
+    Counter forcedCloses[17];
+    // payload bytes of text and binary messages both ways and nanoseconds spent in the message callback
+    MetricsHistogram messageSize, callbackTime;
+
+    void received(OpCode opCode, size_t length) {
+        messagesIn[opCode & 15].add();
+        bytesIn[opCode & 15].add(length);
+        if (opCode < 3) {
+            messageSize.record(length);
+        }
+    }
+
+    void sent(OpCode opCode, size_t length) {
+        messagesOut[opCode & 15].add();
+        bytesOut[opCode & 15].add(length);
+        if (opCode < 3) {
+            messageSize.record(length);
+        }
+    }
+
+    void forcedClose(unsigned short code) {
+        forcedCloses[code >= 1000 && code <= 1015 ? code - 1000 : 16].add();
+    }
+
+    MetricsSnapshot snapshot() const;
+};
+
+}
+
+#endif // METRICS_H
@@ -45,6 +45,7 @@ inline SOCKET dup(SOCKET socket) {
 #else
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <cstring>
 #define SOCKET_ERROR -1
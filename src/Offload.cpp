@@ -0,0 +1,248 @@
+#include "Offload.h"
+#include "Server.h"
+#include "Extensions.h"
+#include "SocketData.h"
+#include "Parser.h"
+
+namespace uWS {
+
+void Backlog::push(uv_poll_t *p, Message message)
+{
+    SocketData *socketData = (SocketData *) p->data;
+    if (!socketData->backlog) {
+        socketData->backlog = new Backlog;
+        socketData->backlog->p = p;
+    }
+
+    socketData->backlog->messages.push(std::move(message));
+    if (!socketData->backlog->inFlight) {
+        process(p);
+    }
+}
+
+// delivers held back messages in order until one is large enough for the thread pool
+void Backlog::process(uv_poll_t *p)
+{
+    SocketData *socketData = (SocketData *) p->data;
+    Backlog *backlog = socketData->backlog;
+    Server *server = socketData->server;
+
+    while (!backlog->messages.empty()) {
+        Message &message = backlog->messages.front();
+        if (message.opCode == CLOSE) {
+            socketData->controlBuffer = std::move(message.data);
+            delete backlog;
+            socketData->backlog = nullptr;
+
+            std::tuple<unsigned short, char *, size_t> closeFrame = Parser::parseCloseFrame(socketData->controlBuffer);
+            WebSocket(p).close(false, std::get<0>(closeFrame), std::get<1>(closeFrame), std::get<2>(closeFrame));
+            return;
+        }
+
+        if (message.compressed) {
+            if (server->compressionPolicy.offloadSize && message.data.length() >= server->compressionPolicy.offloadSize) {
+                backlog->submit();
+                return;
+            }
+
+            std::string inflated;
+            socketData->pmd->acquireReadStream();
+            bool inflatedMessage = socketData->pmd->inflateMessage((char *) message.data.data(), message.data.length(), inflated, server->inflateLimit(message.data.length()));
+            socketData->pmd->releaseReadStream();
+            if (!inflatedMessage) {
+                WebSocket(p).close(true, 1006);
+                return;
+            }
+            server->metrics.inflateIn.add(message.data.length());
+            server->metrics.inflateOut.add(inflated.length());
+            message.data.swap(inflated);
+        }
+
+        Message delivered = std::move(message);
+        backlog->messages.pop();
+        if ((server->maxPayload && delivered.data.length() > server->maxPayload) || (delivered.opCode == TEXT && !isValidUtf8((unsigned char *) delivered.data.data(), delivered.data.length()))) {
+            WebSocket(p).close(true, 1006);
+            return;
+        }
+
+        server->deliverMessage(p, (char *) delivered.data.data(), delivered.data.length(), delivered.opCode);
+        if (uv_is_closing((uv_handle_t *) p) || socketData->state == CLOSING) {
+            return;
+        }
+    }
+
+    delete backlog;
+    socketData->backlog = nullptr;
+}
+
+// the read stream is lent out on the loop thread, the pool thread only touches input, inflated and the stream
+void Backlog::submit()
+{
+    SocketData *socketData = (SocketData *) p->data;
+    pmd = socketData->pmd;
+    pmd->acquireReadStream();
+    pmd->jobs++;
+    input.swap(messages.front().data);
+    maxLength = socketData->server->inflateLimit(input.length());
+    inFlight = true;
+
+    work.data = this;
+    uv_queue_work(socketData->server->loop, &work, [](uv_work_t *work) {
+        Backlog *backlog = (Backlog *) work->data;
+        backlog->failed = !backlog->pmd->inflateMessage((char *) backlog->input.data(), backlog->input.length(), backlog->inflated, backlog->maxLength);
+    }, [](uv_work_t *work, int status) {
+        Backlog *backlog = (Backlog *) work->data;
+        PerMessageDeflate *pmd = backlog->pmd;
+        backlog->inFlight = false;
+        pmd->jobs--;
+        if (backlog->cancelled) {
+            if (pmd->orphaned && !pmd->jobs) {
+                delete pmd;
+            }
+            delete backlog;
+            return;
+        }
+
+        pmd->releaseReadStream();
+        if (backlog->failed) {
+            WebSocket(backlog->p).close(true, 1006);
+            return;
+        }
+
+        Server *server = ((SocketData *) backlog->p->data)->server;
+        server->metrics.inflateIn.add(backlog->input.length());
+        server->metrics.inflateOut.add(backlog->inflated.length());
+        Message &message = backlog->messages.front();
+        message.data.swap(backlog->inflated);
+        message.compressed = false;
+        backlog->input.clear();
+        backlog->inflated.clear();
+        process(backlog->p);
+    });
+}
+
+// the socket is going away, a job in flight deletes us when it returns
+void Backlog::cancel()
+{
+    if (inFlight) {
+        cancelled = true;
+    } else {
+        delete this;
+    }
+}
+
+DeflateJob::DeflateJob(Server *server, const char *data, size_t length, OpCode opCode, PerMessageDeflate *pmd) : server(server), input(data, length), opCode(opCode), pmd(pmd)
+{
+    level = server->compressionLevel();
+    if (pmd) {
+        pmd->jobs++;
+        windowBits = pmd->serverWindowBits;
+        memLevel = pmd->memLevel;
+    } else {
+        windowBits = server->serverMaxWindowBits;
+        memLevel = server->memLevel;
+    }
+
+    if (pmd && !pmd->serverNoContextTakeover) {
+        stream = pmd->writeStream;
+        pmd->writeStreamBusy = true;
+    } else {
+        stream = server->es.zlibPool->getDeflateStream(windowBits, memLevel);
+    }
+}
+
+// queues a placeholder the writable callback stops at until the frame is filled in
+void DeflateJob::addReceiver(uv_poll_t *p)
+{
+    SocketData::Queue::Message *messagePtr = (SocketData::Queue::Message *) new char[sizeof(SocketData::Queue::Message) + sizeof(Ticket)];
+    Ticket *ticket = (Ticket *) (messagePtr + 1);
+    ticket->job = this;
+    ticket->p = p;
+    ticket->index = tickets.size();
+    tickets.push_back(ticket);
+    references++;
+
+    messagePtr->data = nullptr;
+    messagePtr->length = 0;
+    messagePtr->nextMessage = nullptr;
+    messagePtr->callback = onTicket;
+    messagePtr->callbackData = ticket;
+    WebSocket(p).flushRecords();
+    ((SocketData *) p->data)->messageQueue.push(messagePtr);
+}
+
+void DeflateJob::onTicket(WebSocket webSocket, void *data, bool cancelled)
+{
+    Ticket *ticket = (Ticket *) data;
+    DeflateJob *job = ticket->job;
+    if (!job->done) {
+        job->tickets[ticket->index] = nullptr;
+    }
+    if (job->callback) {
+        job->callback(webSocket, job->callbackData, cancelled);
+    }
+    job->release();
+}
+
+void DeflateJob::submit()
+{
+    work.data = this;
+    uv_queue_work(server->loop, &work, [](uv_work_t *work) {
+        DeflateJob *job = (DeflateJob *) work->data;
+        size_t compressedLength;
+        job->frame = PerMessageDeflate::deflate(job->stream, job->input.data(), job->input.length(), 10, compressedLength, true, job->level);
+        if (job->frame) {
+            job->frameLength = formatMessage(job->frame, job->frame + 10, compressedLength, job->opCode, compressedLength, true);
+        }
+    }, [](uv_work_t *work, int status) {
+        DeflateJob *job = (DeflateJob *) work->data;
+        job->done = true;
+
+        if (job->pmd && !job->pmd->serverNoContextTakeover) {
+            job->pmd->writeStreamBusy = false;
+        } else {
+            job->server->es.zlibPool->putDeflateStream(job->stream, job->windowBits, job->memLevel);
+        }
+
+        if (job->frameLength) {
+            job->server->recordCompression(job->pmd, job->input.length(), job->frameLength);
+        }
+        if (job->pmd && !--job->pmd->jobs && job->pmd->orphaned) {
+            delete job->pmd;
+        }
+        job->pmd = nullptr;
+        std::string().swap(job->input);
+
+        for (Ticket *ticket : job->tickets) {
+            if (!ticket) {
+                continue;
+            }
+
+            uv_poll_t *p = ticket->p;
+            if (!job->frameLength) {
+                WebSocket(p).close(true, 1006);
+                continue;
+            }
+
+            SocketData *socketData = (SocketData *) p->data;
+            SocketData::Queue::Message *messagePtr = (SocketData::Queue::Message *) ticket - 1;
+            messagePtr->data = job->frame;
+            messagePtr->length = job->frameLength;
+            job->server->metrics.queuedBytes.add(job->frameLength);
+            if (socketData->messageQueue.front() == messagePtr) {
+                uv_poll_start(p, UV_WRITABLE | UV_READABLE, WebSocket::onWritableReadable);
+            }
+        }
+        job->release();
+    });
+}
+
+void DeflateJob::release()
+{
+    if (!--references) {
+        delete [] frame;
+        delete this;
+    }
+}
+
+}
@@ -0,0 +1,71 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <string>
+#include <queue>
+#include <vector>
+#include <uv.h>
+#include <zlib.h>
+
+#include "WebSocket.h"
+
+struct PerMessageDeflate;
+
+namespace uWS {
+
+// whole messages of one socket held back while an earlier one is inflated on the thread pool
+struct Backlog {
+    struct Message {
+        std::string data;
+        OpCode opCode;
+        bool compressed;
+    };
+
+    uv_work_t work;
+    uv_poll_t *p;
+    PerMessageDeflate *pmd;
+    std::queue<Message> messages;
+    std::string input, inflated;
+    size_t maxLength;
+    bool inFlight = false, cancelled = false, failed = false;
+
+    static void push(uv_poll_t *p, Message message);
+    static void process(uv_poll_t *p);
+    void submit();
+    void cancel();
+};
+
+// one deflated frame filled into a placeholder in the queue of every receiver once the thread pool is done
+struct DeflateJob {
+    struct Ticket {
+        DeflateJob *job;
+        uv_poll_t *p;
+        size_t index;
+    };
+
+    uv_work_t work;
+    Server *server;
+    std::string input;
+    OpCode opCode;
+    int level;
+    z_stream *stream;
+    PerMessageDeflate *pmd;
+    int windowBits, memLevel;
+    char *frame = nullptr;
+    size_t frameLength = 0;
+    bool done = false;
+    int references = 1;
+    std::vector<Ticket *> tickets;
+    void (*callback)(WebSocket webSocket, void *data, bool cancelled) = nullptr;
+    void *callbackData = nullptr;
+
+    DeflateJob(Server *server, const char *data, size_t length, OpCode opCode, PerMessageDeflate *pmd);
+    void addReceiver(uv_poll_t *p);
+    void submit();
+    void release();
+    static void onTicket(WebSocket webSocket, void *data, bool cancelled);
+};
+
+}
+
+#endif // OFFLOAD_H
@@ -5,11 +5,93 @@
 #include "UTF8.h"
 #include "Network.h"
 #include <uv.h>
+#include <openssl/rand.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PARSER_SSE2
+#endif
 
 #define STRICT_WS
 
 namespace uWS {
 
+// xors length bytes with the repeating 4 byte mask, 16 bytes at a time where SSE2 is available
+inline void maskPayload(char *data, size_t length, const char *mask)
+{
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    size_t i = 0;
+#ifdef PARSER_SSE2
+    const __m128i mask128 = _mm_set1_epi32(mask32);
+    for (; i + 16 <= length; i += 16) {
+        __m128i *block = (__m128i *) (data + i);
+        _mm_storeu_si128(block, _mm_xor_si128(_mm_loadu_si128(block), mask128));
+    }
+#endif
+    const uint64_t mask64 = ((uint64_t) mask32 << 32) | mask32;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t block;
+        memcpy(&block, data + i, 8);
+        block ^= mask64;
+        memcpy(data + i, &block, 8);
+    }
+    for (; i < length; i++) {
+        data[i] ^= mask[i % 4];
+    }
+}
+
+// masks only need to be unguessable to whoever sits between client and server, a xorshift seeded once per thread is plenty
+inline uint32_t nextMask()
+{
+    static __thread uint64_t state = 0;
+    if (!state) {
+        RAND_bytes((unsigned char *) &state, sizeof(state));
+        state |= 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+// dst needs room for 14 bytes of header, masked frames (SND_MASKED) use all of them
+inline size_t formatMessage(char *dst, const char *src, size_t length, OpCode opCode, size_t reportedLength, bool compressed, int flags = 0)
+{
+    size_t headerLength;
+    if (reportedLength < 126) {
+        headerLength = 2;
+        dst[1] = reportedLength;
+    } else if (reportedLength <= UINT16_MAX) {
+        headerLength = 4;
+        dst[1] = 126;
+    } else {
+        headerLength = 10;
+        dst[1] = 127;
+    }
+
+    char *payload = dst + headerLength + (flags & SND_MASKED ? 4 : 0);
+    memmove(payload, src, length);
+    if (headerLength == 4) {
+        *((uint16_t *) &dst[2]) = htons(reportedLength);
+    } else if (headerLength == 10) {
+        *((uint64_t *) &dst[2]) = htobe64(reportedLength);
+    }
+
+    dst[0] = (flags & SND_NO_FIN ? 0 : 128) | (compressed ? SND_COMPRESSED : 0);
+    if (!(flags & SND_CONTINUATION)) {
+        dst[0] |= opCode;
+    }
+
+    if (flags & SND_MASKED) {
+        dst[1] |= 128;
+        uint32_t mask = nextMask();
+        memcpy(payload - 4, &mask, 4);
+        maskPayload(payload, length, payload - 4);
+    }
+    return payload - dst + length;
+}
+
 class Parser {
 private:
     typedef uint16_t frameFormat;
@@ -56,26 +138,33 @@ private:
         }
     }
 
-    template <typename T>
+    // servers unmask in place, shifting the payload back over its header, clients read it where it is
+    template <bool isServer, typename T>
     static inline void consumeIncompleteMessage(int length, const int headerLength, T fullPayloadLength, SocketData *socketData, char *src, uv_poll_t *p)
     {
         socketData->spillLength = 0;
         socketData->state = READ_MESSAGE;
         socketData->remainingBytes = fullPayloadLength - length + headerLength;
 
-        memcpy(socketData->mask, src + headerLength - 4, 4);
-        unmask_imprecise(src, src + headerLength, socketData->mask, length);
-        rotate_mask(4 - (length - headerLength) % 4, socketData->mask);
+        if (isServer) {
+            memcpy(socketData->mask, src + headerLength - 4, 4);
+            unmask_imprecise(src, src + headerLength, socketData->mask, length);
+            rotate_mask(4 - (length - headerLength) % 4, socketData->mask);
+        } else {
+            src += headerLength;
+        }
 
         WebSocket(p).handleFragment(src, length - headerLength,
                                     socketData->opCode[(unsigned char) socketData->opStack], socketData->fin, socketData->remainingBytes, socketData->pmd && socketData->pmd->compressedFrame);
     }
 
-    template <typename T>
+    template <bool isServer, typename T>
     static inline int consumeCompleteMessage(int &length, const int headerLength, T fullPayloadLength, SocketData *socketData, char **src, frameFormat &frame, uv_poll_t *p)
     {
-        unmask_imprecise_copy_mask(*src, *src + headerLength, *src + headerLength - 4, fullPayloadLength);
-        WebSocket(p).handleFragment(*src, fullPayloadLength, socketData->opCode[(unsigned char) socketData->opStack], socketData->fin, 0, socketData->pmd && socketData->pmd->compressedFrame);
+        if (isServer) {
+            unmask_imprecise_copy_mask(*src, *src + headerLength, *src + headerLength - 4, fullPayloadLength);
+        }
+        WebSocket(p).handleFragment(*src + (isServer ? 0 : headerLength), fullPayloadLength, socketData->opCode[(unsigned char) socketData->opStack], socketData->fin, 0, socketData->pmd && socketData->pmd->compressedFrame);
 
         if (uv_is_closing((uv_handle_t *) p) || socketData->state == CLOSING) {
             return 1;
@@ -91,11 +180,13 @@ private:
         return 0;
     }
 
+    template <bool isServer>
     static inline void consumeEntireBuffer(char *src, int length, SocketData *socketData, uv_poll_t *p)
     {
-        int n = (length >> 2) + bool(length % 4); // this should always overwrite!
-
-        unmask_inplace(src, src + n * 4, socketData->mask);
+        if (isServer) {
+            int n = (length >> 2) + bool(length % 4); // this should always overwrite!
+            unmask_inplace(src, src + n * 4, socketData->mask);
+        }
         socketData->remainingBytes -= length;
         WebSocket(p).handleFragment((const char *) src, length,
                                     socketData->opCode[(unsigned char) socketData->opStack], socketData->fin, socketData->remainingBytes, socketData->pmd && socketData->pmd->compressedFrame);
@@ -111,17 +202,20 @@ private:
             if (socketData->fin) {
                 socketData->opStack--;
             }
-        } else if (length % 4) {
+        } else if (isServer && length % 4) {
             rotate_mask(4 - (length % 4), socketData->mask);
         }
     }
 
+    template <bool isServer>
     static inline int consumeCompleteTail(char **src, int &length, SocketData *socketData, uv_poll_t *p)
     {
-        int n = (socketData->remainingBytes >> 2);
-        unmask_inplace(*src, *src + n * 4, socketData->mask);
-        for (int i = 0, s = socketData->remainingBytes % 4; i < s; i++) {
-            (*src)[n * 4 + i] ^= socketData->mask[i];
+        if (isServer) {
+            int n = (socketData->remainingBytes >> 2);
+            unmask_inplace(*src, *src + n * 4, socketData->mask);
+            for (int i = 0, s = socketData->remainingBytes % 4; i < s; i++) {
+                (*src)[n * 4 + i] ^= socketData->mask[i];
+            }
         }
 
         WebSocket(p).handleFragment((const char *) *src, socketData->remainingBytes,
@@ -146,8 +240,13 @@ public:
     // LONG_MESSAGE_HEADER + 4 byte mask
     static const int CONSUME_POST_PADDING = 18;
 
+    // frames from clients are masked, frames to a client (isServer = false) never are
+    template <bool isServer = true>
     static inline void consume(int length, char *src, SocketData *socketData, uv_poll_t *p)
     {
+        // the mask key is the only difference in the header
+        const int MASK_LENGTH = isServer ? 4 : 0;
+
         parseNext:
         if (socketData->state == READ_HEAD) {
             while (length >= (int) sizeof(frameFormat)) {
@@ -172,6 +271,12 @@ public:
                     WebSocket(p).close(true, 1006);
                     return;
                 }
+
+                // a server must not mask
+                if (!isServer && mask(frame)) {
+                    WebSocket(p).close(true, 1006);
+                    return;
+                }
     #endif
 
                 // do not store opCode continuation!
@@ -206,51 +311,51 @@ public:
 
                 if (payloadLength(frame) > 125) {
                     if (payloadLength(frame) == 126) {
-                        const int MEDIUM_MESSAGE_HEADER = 8;
+                        const int MEDIUM_MESSAGE_HEADER = 4 + MASK_LENGTH;
                         // we need to have enough length to read the long length
                         if (length < 2 + (int) sizeof(uint16_t)) {
                             break;
                         }
                         if (ntohs(*(uint16_t *) &src[2]) <= length - MEDIUM_MESSAGE_HEADER) {
-                            if (consumeCompleteMessage(length, MEDIUM_MESSAGE_HEADER, ntohs(*(uint16_t *) &src[2]), socketData, &src, frame, p)) {
+                            if (consumeCompleteMessage<isServer>(length, MEDIUM_MESSAGE_HEADER, ntohs(*(uint16_t *) &src[2]), socketData, &src, frame, p)) {
                                 return;
                             }
                         } else {
                             if (length < MEDIUM_MESSAGE_HEADER + 1) {
                                 break;
                             }
-                            consumeIncompleteMessage(length, MEDIUM_MESSAGE_HEADER, ntohs(*(uint16_t *) &src[2]), socketData, src, p);
+                            consumeIncompleteMessage<isServer>(length, MEDIUM_MESSAGE_HEADER, ntohs(*(uint16_t *) &src[2]), socketData, src, p);
                             return;
                         }
                     } else {
-                        const int LONG_MESSAGE_HEADER = 14;
-                        // we need to have enough length to read the long length
-                        if (length < 2 + (int) sizeof(uint64_t)) {
+                        const int LONG_MESSAGE_HEADER = 10 + MASK_LENGTH;
+                        // we need the whole header, the unsigned comparison below would wrap on a shorter one
+                        if (length < LONG_MESSAGE_HEADER) {
                             break;
                         }
                         if (be64toh(*(uint64_t *) &src[2]) <= (uint64_t) length - LONG_MESSAGE_HEADER) {
-                            if (consumeCompleteMessage(length, LONG_MESSAGE_HEADER, be64toh(*(uint64_t *) &src[2]), socketData, &src, frame, p)) {
+                            if (consumeCompleteMessage<isServer>(length, LONG_MESSAGE_HEADER, be64toh(*(uint64_t *) &src[2]), socketData, &src, frame, p)) {
                                 return;
                             }
                         } else {
                             if (length < LONG_MESSAGE_HEADER + 1) {
                                 break;
                             }
-                            consumeIncompleteMessage(length, LONG_MESSAGE_HEADER, be64toh(*(uint64_t *) &src[2]), socketData, src, p);
+                            consumeIncompleteMessage<isServer>(length, LONG_MESSAGE_HEADER, be64toh(*(uint64_t *) &src[2]), socketData, src, p);
                             return;
                         }
                     }
                 } else {
-                    const int SHORT_MESSAGE_HEADER = 6;
+                    const int SHORT_MESSAGE_HEADER = 2 + MASK_LENGTH;
                     if (payloadLength(frame) <= length - SHORT_MESSAGE_HEADER) {
-                        if (consumeCompleteMessage(length, SHORT_MESSAGE_HEADER, payloadLength(frame), socketData, &src, frame, p)) {
+                        if (consumeCompleteMessage<isServer>(length, SHORT_MESSAGE_HEADER, payloadLength(frame), socketData, &src, frame, p)) {
                             return;
                         }
                     } else {
                         if (length < SHORT_MESSAGE_HEADER + 1) {
                             break;
                         }
-                        consumeIncompleteMessage(length, SHORT_MESSAGE_HEADER, payloadLength(frame), socketData, src, p);
+                        consumeIncompleteMessage<isServer>(length, SHORT_MESSAGE_HEADER, payloadLength(frame), socketData, src, p);
                         return;
                     }
                 }
@@ -261,12 +366,12 @@ public:
             }
         } else {
             if (socketData->remainingBytes < (unsigned int) length) {
-                if (consumeCompleteTail(&src, length, socketData, p)) {
+                if (consumeCompleteTail<isServer>(&src, length, socketData, p)) {
                     return;
                 }
                 goto parseNext;
             } else {
-                consumeEntireBuffer(src, length, socketData, p);
+                consumeEntireBuffer<isServer>(src, length, socketData, p);
             }
         }
     }
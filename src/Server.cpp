@@ -4,24 +4,48 @@
 #include "WebSocket.h"
 #include "Extensions.h"
 #include "Parser.h"
+#include "Offload.h"
+#include "StaticFiles.h"
 
 #include <cstring>
+#include <ctime>
+#include <atomic>
+#include <algorithm>
 #include <openssl/sha.h>
 #include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#ifdef __linux__
+#include <linux/sock_diag.h>
+#endif
 
-void base64(unsigned char *src, char *dst)
+// padded base64 of any length, dst needs room for 4 characters per started 3 bytes
+void base64(const unsigned char *src, size_t length, char *dst)
 {
     static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-    for (int i = 0; i < 18; i += 3) {
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
         *dst++ = b64[(src[i] >> 2) & 63];
         *dst++ = b64[((src[i] & 3) << 4) | ((src[i + 1] & 240) >> 4)];
         *dst++ = b64[((src[i + 1] & 15) << 2) | ((src[i + 2] & 192) >> 6)];
         *dst++ = b64[src[i + 2] & 63];
     }
-    *dst++ = b64[(src[18] >> 2) & 63];
-    *dst++ = b64[((src[18] & 3) << 4) | ((src[19] & 240) >> 4)];
-    *dst++ = b64[((src[19] & 15) << 2)];
-    *dst++ = '=';
+    if (i + 1 == length) {
+        *dst++ = b64[(src[i] >> 2) & 63];
+        *dst++ = b64[((src[i] & 3) << 4)];
+        *dst++ = '=';
+        *dst++ = '=';
+    } else if (i + 2 == length) {
+        *dst++ = b64[(src[i] >> 2) & 63];
+        *dst++ = b64[((src[i] & 3) << 4) | ((src[i + 1] & 240) >> 4)];
+        *dst++ = b64[((src[i + 1] & 15) << 2)];
+        *dst++ = '=';
+    }
 }
 
 namespace uWS {
@@ -33,6 +57,7 @@ void Server::acceptHandler(uv_poll_t *p, int status, int events)
     }
 
     Server *server = (Server *) p->data;
+    server->es.event();
 
     socklen_t listenAddrLength = sizeof(sockaddr_in);
     uv_os_sock_t serverFd;
@@ -47,24 +72,49 @@ void Server::acceptHandler(uv_poll_t *p, int status, int events)
     setsockopt(clientFd, SOL_SOCKET, SO_NOSIGPIPE, &noSigpipe, sizeof(int));
 #endif
 
+    // frames and TLS records are sent whole and pipelined responses corked, Nagle would only hold back a second send
+    // until the peer's delayed ack, like the 101 behind the session tickets of TLS 1.3
+    int noDelay = 1;
+    setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+
     void *ssl = nullptr;
     if (server->sslContext) {
         ssl = server->sslContext.newSSL(clientFd);
         SSL_set_accept_state((SSL *) ssl);
     }
 
+    // the handshake is left to whichever thread adopts the connection
+    if (server->acceptCallback) {
+        server->acceptCallback(clientFd, ssl);
+        return;
+    }
+
     uv_poll_t *clientPoll = new uv_poll_t;
     uv_poll_init_socket(server->loop, clientPoll, clientFd);
     new HTTPSocket(clientPoll, server, ssl);
 }
 
+// the queues are taken under the lock and handled without it so callbacks can upgrade and adopt themselves
 void Server::upgradeHandler(Server *server)
 {
+    std::queue<std::pair<uv_os_sock_t, void *>> adoptQueue;
+    std::queue<UpgradeRequest> upgradeQueue;
     server->upgradeQueueMutex.lock();
+    adoptQueue.swap(server->adoptQueue);
+    upgradeQueue.swap(server->upgradeQueue);
+    server->upgradeQueueMutex.unlock();
+
+    while (!adoptQueue.empty()) {
+        std::pair<uv_os_sock_t, void *> adopted = adoptQueue.front();
+        adoptQueue.pop();
+
+        uv_poll_t *clientPoll = new uv_poll_t;
+        uv_poll_init_socket(server->loop, clientPoll, adopted.first);
+        new HTTPSocket(clientPoll, server, adopted.second);
+    }
 
-    while (!server->upgradeQueue.empty()) {
-        UpgradeRequest upgradeRequest = server->upgradeQueue.front();
-        server->upgradeQueue.pop();
+    while (!upgradeQueue.empty()) {
+        UpgradeRequest &upgradeRequest = upgradeQueue.front();
 
         unsigned char shaInput[] = "XXXXXXXXXXXXXXXXXXXXXXXX258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
         memcpy(shaInput, upgradeRequest.secKey.data(), 24);
@@ -72,7 +122,7 @@ void Server::upgradeHandler(Server *server)
         SHA1(shaInput, sizeof(shaInput) - 1, shaDigest);
 
         memcpy(server->upgradeBuffer, "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ", 97);
-        base64(shaDigest, server->upgradeBuffer + 97);
+        base64(shaDigest, SHA_DIGEST_LENGTH, server->upgradeBuffer + 97);
         memcpy(server->upgradeBuffer + 125, "\r\n", 2);
         size_t upgradeResponseLength = 127;
 
@@ -82,9 +132,9 @@ void Server::upgradeHandler(Server *server)
         // Note: This could be moved into Extensions.cpp as a "decorator" if we get more complex extension support
         PerMessageDeflate *perMessageDeflate = nullptr;
         ExtensionsParser extensionsParser(upgradeRequest.extensions.c_str());
-        if ((server->options & PERMESSAGE_DEFLATE) && extensionsParser.perMessageDeflate) {
+        if ((server->options & PERMESSAGE_DEFLATE) && extensionsParser.acceptable()) {
             std::string response;
-            perMessageDeflate = new PerMessageDeflate(extensionsParser, server->options, response);
+            perMessageDeflate = new PerMessageDeflate(extensionsParser, server->options & SERVER_NO_CONTEXT_TAKEOVER, server->options & CLIENT_NO_CONTEXT_TAKEOVER, server->serverMaxWindowBits, server->clientMaxWindowBits, server->memLevel, server->es.zlibPool, response);
             response.append("\r\n");
             response.append(stamp);
             memcpy(server->upgradeBuffer + 127, response.data(), response.length());
@@ -103,10 +153,19 @@ void Server::upgradeHandler(Server *server)
             webSocket.link(server->clients);
         }
         server->clients = clientPoll;
+        server->metrics.upgrades.add();
+        server->metrics.connections.add();
         server->connectionCallback(webSocket);
-    }
 
-    server->upgradeQueueMutex.unlock();
+        // frames the client pipelined behind its upgrade request
+        webSocket.consumeBuffered(upgradeRequest.buffered.data(), upgradeRequest.buffered.length());
+
+        // OpenSSL may hold more of what came along, the socket itself would not wake us for it
+        if (upgradeRequest.ssl && !uv_is_closing((uv_handle_t *) clientPoll) && SSL_has_pending((SSL *) upgradeRequest.ssl)) {
+            WebSocket::onReadable(clientPoll, 0, UV_READABLE);
+        }
+        upgradeQueue.pop();
+    }
 }
 
 void Server::closeHandler(Server *server)
@@ -136,20 +195,17 @@ Server::Server(EventSystem &es, int port, unsigned int options, unsigned int max
     loop = es.loop;
     master = es.loopType == MASTER;
 
+    onHttpDisconnection([](HTTPResponse response) {});
     onConnection([](WebSocket webSocket) {});
+    onConnectionError([](void *user) {});
     onDisconnection([](WebSocket webSocket, int code, char *message, size_t length) {});
     onMessage([](WebSocket webSocket, char *message, size_t length, OpCode opCode) {});
     onPing([](WebSocket webSocket, char *message, size_t length) {});
     onPong([](WebSocket webSocket, char *message, size_t length) {});
-    onUpgrade([this](uv_os_sock_t fd, const char *secKey, void *ssl, const char *extensions, size_t extensionsLength) {
-        upgrade(fd, secKey, ssl, extensions, extensionsLength);
+    onUpgrade([this](uv_os_sock_t fd, const char *secKey, void *ssl, const char *extensions, size_t extensionsLength, const char *buffered, size_t bufferedLength, HTTPRequest request) {
+        upgrade(fd, secKey, ssl, extensions, extensionsLength, buffered, bufferedLength);
     });
-
-    // todo: move this into PerMessageDeflate class
-    writeStream = {};
-    if (deflateInit2(&writeStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
-        throw ERR_ZLIB;
-    }
+    setCompressionPolicy(compressionPolicy);
 
     if (port) {
         uv_os_sock_t listenFd = socket(AF_INET, SOCK_STREAM, 0);
@@ -161,7 +217,6 @@ Server::Server(EventSystem &es, int port, unsigned int options, unsigned int max
         setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
         if (bind(listenFd, (sockaddr *) &listenAddr, sizeof(sockaddr_in)) || listen(listenFd, 10)) {
-            deflateEnd(&writeStream);
             throw ERR_LISTEN;
         }
 
@@ -197,20 +252,51 @@ Server::~Server()
     delete [] sendBuffer;
     delete [] inflateBuffer;
 
-    // todo: move this into PerMessageDeflate class
-    deflateEnd(&writeStream);
+    for (StaticFiles *files : staticFiles) {
+        delete files;
+    }
 }
 
-void Server::onUpgrade(std::function<void (uv_os_sock_t, const char *, void *, const char *, size_t)> upgradeCallback)
+// only accept() runs here, the SSL is created but its handshake, like the HTTP one, happens after adopt()
+void Server::onAccept(std::function<void(uv_os_sock_t, void *)> acceptCallback)
+{
+    this->acceptCallback = acceptCallback;
+}
+
+// every completed TLS handshake with how long it took since the connection reached this server, failed ones are only closed
+void Server::onHandshake(std::function<void(unsigned long long, bool)> handshakeCallback)
+{
+    this->handshakeCallback = handshakeCallback;
+}
+
+void Server::onUpgrade(std::function<void (uv_os_sock_t, const char *, void *, const char *, size_t, const char *, size_t, HTTPRequest)> upgradeCallback)
 {
     this->upgradeCallback = upgradeCallback;
 }
 
+// requests without a handler are closed as before, keep-alive connections wait for each response before the next pipelined request
+void Server::onHttpRequest(std::function<void(HTTPResponse, HTTPRequest, char *, size_t)> httpRequestCallback)
+{
+    this->httpRequestCallback = httpRequestCallback;
+}
+
+// a connection went away while its request was not ended yet
+void Server::onHttpDisconnection(std::function<void(HTTPResponse)> httpDisconnectionCallback)
+{
+    this->httpDisconnectionCallback = httpDisconnectionCallback;
+}
+
 void Server::onConnection(std::function<void (WebSocket)> connectionCallback)
 {
     this->connectionCallback = connectionCallback;
 }
 
+// an EventSystem::connect that failed before its upgrade was answered
+void Server::onConnectionError(std::function<void (void *)> connectionErrorCallback)
+{
+    this->connectionErrorCallback = connectionErrorCallback;
+}
+
 void Server::onDisconnection(std::function<void (WebSocket, int, char *, size_t)> disconnectionCallback)
 {
     this->disconnectionCallback = disconnectionCallback;
@@ -241,10 +327,10 @@ void Server::close(bool force)
     }
 }
 
-void Server::upgrade(uv_os_sock_t fd, const char *secKey, void *ssl, const char *extensions, size_t extensionsLength)
+void Server::upgrade(uv_os_sock_t fd, const char *secKey, void *ssl, const char *extensions, size_t extensionsLength, const char *buffered, size_t bufferedLength)
 {
     upgradeQueueMutex.lock();
-    upgradeQueue.push({fd, std::string(secKey, 24), ssl, std::string(extensions, extensionsLength)});
+    upgradeQueue.push({fd, std::string(secKey, 24), ssl, std::string(extensions, extensionsLength), std::string(buffered, bufferedLength)});
     upgradeQueueMutex.unlock();
 
     if (master) {
@@ -254,41 +340,386 @@ void Server::upgrade(uv_os_sock_t fd, const char *secKey, void *ssl, const char
     }
 }
 
-void Server::broadcast(char *data, size_t length, OpCode opCode)
+void Server::adopt(uv_os_sock_t fd, void *ssl)
 {
-    WebSocket::PreparedMessage *preparedMessage = WebSocket::prepareMessage(data, length, opCode, false);
-    if (options & PERMESSAGE_DEFLATE && options & SERVER_NO_CONTEXT_TAKEOVER) {
-        size_t compressedLength = compress(data, length, inflateBuffer);
-        WebSocket::PreparedMessage *preparedCompressedMessage = WebSocket::prepareMessage(inflateBuffer, compressedLength, opCode, true);
+    upgradeQueueMutex.lock();
+    adoptQueue.push({fd, ssl});
+    upgradeQueueMutex.unlock();
 
-        for (WebSocket webSocket = clients; webSocket; webSocket = webSocket.next()) {
-            SocketData *socketData = (SocketData *) webSocket.p->data;
-            webSocket.sendPrepared(socketData->pmd ? preparedCompressedMessage : preparedMessage);
+    if (master) {
+        upgradeHandler(this);
+    } else {
+        uv_async_send(&upgradeAsync);
+    }
+}
+
+// upgrades whose path starts with the whole segments of prefix go round robin to targets before onUpgrade sees them
+void Server::route(std::string prefix, std::vector<Server *> targets)
+{
+    if (prefix.length() > 1 && prefix.back() == '/') {
+        prefix.pop_back();
+    }
+    routes.push_back({prefix, targets, 0});
+}
+
+// the longest matching prefix wins
+Server *Server::match(HTTPRequest &request)
+{
+    Route *longest = nullptr;
+    unsigned int pathLength = request.getPathLength();
+    for (Route &route : routes) {
+        size_t length = route.prefix.length();
+        if (length <= pathLength && !memcmp(request.url, route.prefix.data(), length)
+                && (length == pathLength || request.url[length] == '/' || route.prefix == "/")
+                && (!longest || length > longest->prefix.length())) {
+            longest = &route;
         }
+    }
 
+    if (!longest || longest->targets.empty()) {
+        return nullptr;
+    }
+    return longest->targets[longest->next++ % longest->targets.size()];
+}
+
+// GET and HEAD requests below prefix are answered from files in directory, index.html for directories
+void Server::serve(std::string prefix, std::string directory)
+{
+    staticFiles.push_back(new StaticFiles(prefix, directory));
+}
+
+StaticFiles *Server::matchStatic(HTTPRequest &request)
+{
+    for (StaticFiles *files : staticFiles) {
+        if (files->matches(request)) {
+            return files;
+        }
+    }
+    return nullptr;
+}
+
+// the snapshot only reads, so servers may run on any thread
+void Server::exportMetrics(std::string path, std::vector<Server *> servers)
+{
+    metricsPath = path;
+    metricsServers = servers;
+}
+
+bool Server::matchMetrics(HTTPRequest &request)
+{
+    return metricsPath.length() && request.methodLength == 3 && !memcmp(request.method, "GET", 3)
+            && request.getPathLength() == metricsPath.length() && !memcmp(request.url, metricsPath.data(), metricsPath.length());
+}
+
+std::string Server::metricsResponse()
+{
+    MetricsSnapshot snapshot = getMetrics();
+    for (Server *server : metricsServers) {
+        if (server != this) {
+            snapshot += server->getMetrics();
+        }
+    }
+
+    std::string body = snapshot.prometheus();
+    return "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.length()) + "\r\n\r\n" + body;
+}
+
+MetricsSnapshot Server::getMetrics()
+{
+    return metrics.snapshot();
+}
+
+// the message callback, timed
+void Server::deliverMessage(WebSocket webSocket, char *message, size_t length, OpCode opCode)
+{
+    metrics.received(opCode, length);
+    uint64_t start = uv_hrtime();
+    messageCallback(webSocket, message, length, opCode);
+    uint64_t elapsed = uv_hrtime() - start;
+    metrics.callbackTime.record(elapsed);
+    es.record(LOOP_CALLBACK, webSocket.p, elapsed);
+}
+
+void Server::broadcast(char *data, size_t length, OpCode opCode)
+{
+    multicast(data, length, opCode, [](WebSocket webSocket) {
+        return true;
+    });
+}
+
+Server::Multicast::~Multicast()
+{
+    if (preparedMessage) {
+        WebSocket::finalizeMessage(preparedMessage);
+    }
+    if (deflateJob) {
+        deflateJob->submit();
+    }
+    if (preparedCompressedMessage) {
         WebSocket::finalizeMessage(preparedCompressedMessage);
+    }
+}
+
+// both variants are built on first use, sockets with their own deflate context get the uncompressed one
+void Server::Multicast::send(WebSocket webSocket)
+{
+    SocketData *socketData = (SocketData *) webSocket.p->data;
+    if (!preparedCompressedMessage && !deflateJob && !uncompressible && socketData->pmd && socketData->pmd->sharedWriteStream) {
+        if (server->compressionPolicy.offloadSize && length >= server->compressionPolicy.offloadSize) {
+            if (server->shouldCompress(nullptr, length, opCode)) {
+                deflateJob = new DeflateJob(server, data, length, opCode, nullptr);
+            } else {
+                uncompressible = true;
+            }
+        } else if (!server->shouldCompress(nullptr, length, opCode) || !(preparedCompressedMessage = server->prepareCompressed(data, length, opCode))) {
+            uncompressible = true;
+        }
+    }
+
+    if (deflateJob && socketData->pmd && socketData->pmd->sharedWriteStream) {
+        deflateJob->addReceiver(webSocket.p);
+    } else if (preparedCompressedMessage && socketData->pmd && socketData->pmd->sharedWriteStream) {
+        webSocket.writePrepared(preparedCompressedMessage);
     } else {
-        for (WebSocket webSocket = clients; webSocket; webSocket = webSocket.next()) {
-            webSocket.sendPrepared(preparedMessage);
+        if (!preparedMessage) {
+            preparedMessage = WebSocket::prepareMessage(data, length, opCode, false);
         }
+        webSocket.writePrepared(preparedMessage);
     }
-    WebSocket::finalizeMessage(preparedMessage);
+    server->metrics.sent(opCode, length);
 }
 
-// todo: move this into PerMessageDeflate class
-size_t Server::compress(char *src, size_t srcLength, char *dst)
+// returns 0 if the result does not fit dstLength
+size_t Server::compress(char *src, size_t srcLength, char *dst, size_t dstLength)
 {
-    deflateReset(&writeStream);
-    writeStream.avail_in = srcLength;
-    writeStream.next_in = (unsigned char *) src;
-    writeStream.avail_out = LARGE_BUFFER_SIZE;
-    writeStream.next_out = (unsigned char *) dst;
-    int err = deflate(&writeStream, Z_SYNC_FLUSH);
-    if (err != Z_OK && err != Z_STREAM_END) {
-        return 0;
-    } else {
-        return LARGE_BUFFER_SIZE - writeStream.avail_out - 4;
+    z_stream *writeStream = es.zlibPool->getDeflateStream(serverMaxWindowBits, memLevel);
+    size_t compressedLength = PerMessageDeflate::deflate(writeStream, src, srcLength, dst, dstLength, true, compressionLevel());
+    es.zlibPool->putDeflateStream(writeStream, serverMaxWindowBits, memLevel);
+    if (compressedLength) {
+        recordCompression(nullptr, srcLength, compressedLength);
     }
+    return compressedLength;
+}
+
+// deflates with the shared stream straight into a frame of any size, nullptr if it did not get smaller
+WebSocket::PreparedMessage *Server::prepareCompressed(char *data, size_t length, OpCode opCode)
+{
+    z_stream *writeStream = es.zlibPool->getDeflateStream(serverMaxWindowBits, memLevel);
+    size_t compressedLength;
+    char *buffer = PerMessageDeflate::deflate(writeStream, data, length, sizeof(SocketData::Queue::Message) + 10, compressedLength, true, compressionLevel());
+    es.zlibPool->putDeflateStream(writeStream, serverMaxWindowBits, memLevel);
+    if (!buffer) {
+        return nullptr;
+    }
+
+    recordCompression(nullptr, length, compressedLength);
+    if (compressedLength >= length) {
+        delete [] buffer;
+        return nullptr;
+    }
+
+    WebSocket::PreparedMessage *preparedMessage = new WebSocket::PreparedMessage;
+    preparedMessage->buffer = buffer + sizeof(SocketData::Queue::Message);
+    preparedMessage->length = formatMessage(preparedMessage->buffer, preparedMessage->buffer + 10, compressedLength, opCode, compressedLength, true);
+    preparedMessage->references = 1;
+    return preparedMessage;
+}
+
+// a message may inflate to maxPayload, but past the shared inflate buffer only to maxInflateRatio times its compressed size
+size_t Server::inflateLimit(size_t compressedLength)
+{
+    size_t limit = maxPayload;
+    if (compressionPolicy.maxInflateRatio) {
+        size_t ratioLimit = std::max<size_t>(LARGE_BUFFER_SIZE, compressedLength * compressionPolicy.maxInflateRatio);
+        if (!limit || ratioLimit < limit) {
+            limit = ratioLimit;
+        }
+    }
+    return limit;
+}
+
+bool Server::shouldCompress(PerMessageDeflate *pmd, size_t length, OpCode opCode)
+{
+    compressionStats.messages++;
+    if (length < compressionPolicy.minSize) {
+        compressionStats.skippedSize++;
+        return false;
+    }
+
+    if ((opCode == TEXT && !compressionPolicy.compressText) || (opCode == BINARY && !compressionPolicy.compressBinary)) {
+        compressionStats.skippedOpCode++;
+        return false;
+    }
+
+    if (pmd && pmd->writeStreamBusy) {
+        compressionStats.skippedBusy++;
+        return false;
+    }
+
+    // give incompressible streams a new sample now and then
+    if (pmd && pmd->incompressible) {
+        if (++pmd->skipped < 16 * compressionPolicy.sampleSize) {
+            compressionStats.skippedRatio++;
+            return false;
+        }
+        pmd->incompressible = false;
+        pmd->skipped = 0;
+    }
+    return true;
+}
+
+int Server::compressionLevel()
+{
+    int level = compressionPolicy.level == Z_DEFAULT_COMPRESSION ? 6 : compressionPolicy.level;
+    if (compressionPolicy.lagThreshold && es.loopLag >= compressionPolicy.lagThreshold && level > 1) {
+        compressionStats.reducedLevel++;
+        level = std::max<int>(1, level - es.loopLag / compressionPolicy.lagThreshold);
+    }
+    return level;
+}
+
+void Server::recordCompression(PerMessageDeflate *pmd, size_t length, size_t compressedLength)
+{
+    compressionStats.compressed++;
+    compressionStats.bytesIn += length;
+    compressionStats.bytesOut += compressedLength;
+    metrics.deflateIn.add(length);
+    metrics.deflateOut.add(compressedLength);
+
+    if (pmd && compressionPolicy.sampleSize) {
+        pmd->sampledIn += length;
+        pmd->sampledOut += compressedLength;
+        if (++pmd->samples == compressionPolicy.sampleSize) {
+            pmd->incompressible = pmd->sampledOut > compressionPolicy.maxRatio * pmd->sampledIn;
+            pmd->samples = 0;
+            pmd->sampledIn = pmd->sampledOut = 0;
+        }
+    }
+}
+
+void Server::setCompressionPolicy(CompressionPolicy compressionPolicy)
+{
+    this->compressionPolicy = compressionPolicy;
+    if ((options & PERMESSAGE_DEFLATE) && compressionPolicy.lagThreshold) {
+        es.measureLag();
+    }
+}
+
+CompressionStats Server::getCompressionStats()
+{
+    return compressionStats;
+}
+
+// a deflate context costs 2^(windowBits + 2) + 2^(memLevel + 9) bytes, an inflate context 2^windowBits
+void Server::setCompressionMemory(int serverMaxWindowBits, int clientMaxWindowBits, int memLevel)
+{
+    if (serverMaxWindowBits < 9 || serverMaxWindowBits > 15 || clientMaxWindowBits < 9 || clientMaxWindowBits > 15 || memLevel < 1 || memLevel > MAX_MEM_LEVEL) {
+        throw ERR_ZLIB;
+    }
+
+    this->serverMaxWindowBits = serverMaxWindowBits;
+    this->clientMaxWindowBits = clientMaxWindowBits;
+    this->memLevel = memLevel;
+}
+
+MemoryUsage Server::getMemoryUsage()
+{
+    MemoryUsage usage;
+    for (WebSocket webSocket = clients; webSocket; webSocket = webSocket.next()) {
+        SocketData *socketData = (SocketData *) webSocket.p->data;
+        usage.sockets++;
+        usage.poll += sizeof(uv_poll_t);
+        usage.socketData += sizeof(SocketData);
+
+        for (SocketData::Queue::Message *message = socketData->messageQueue.head; message; message = message->nextMessage) {
+            usage.queue += sizeof(SocketData::Queue::Message) + message->length;
+        }
+
+        usage.buffers += socketData->buffer.capacity() + socketData->controlBuffer.capacity();
+        if (socketData->records) {
+            usage.buffers += sizeof(SocketData::Records) + socketData->records->data.capacity()
+                    + socketData->records->callbacks.capacity() * sizeof(socketData->records->callbacks[0]);
+        }
+        if (socketData->backlog) {
+            usage.buffers += sizeof(Backlog) + socketData->backlog->input.capacity() + socketData->backlog->inflated.capacity();
+        }
+
+        if (socketData->pmd) {
+            usage.zlib += socketData->pmd->memoryUsage();
+        }
+
+#ifdef __linux__
+        uv_os_sock_t fd;
+        uv_fileno((uv_handle_t *) webSocket.p, (uv_os_fd_t *) &fd);
+        uint32_t memInfo[SK_MEMINFO_VARS];
+        socklen_t memInfoLength = sizeof(memInfo);
+        if (!getsockopt(fd, SOL_SOCKET, SO_MEMINFO, memInfo, &memInfoLength)) {
+            usage.kernel += memInfo[SK_MEMINFO_RMEM_ALLOC] + memInfo[SK_MEMINFO_WMEM_QUEUED] + memInfo[SK_MEMINFO_FWD_ALLOC] + memInfo[SK_MEMINFO_OPTMEM];
+        }
+#endif
+    }
+    return usage;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+// every block OpenSSL gets carries its size in front
+static std::atomic<long long> sslMemory(0);
+
+static void *sslMalloc(size_t size, const char *file, int line)
+{
+    size_t *block = (size_t *) malloc(size + 16);
+    if (!block) {
+        return nullptr;
+    }
+    *block = size;
+    sslMemory += size;
+    return block + 2;
+}
+
+static void sslFree(void *p, const char *file, int line)
+{
+    if (p) {
+        size_t *block = (size_t *) p - 2;
+        sslMemory -= *block;
+        free(block);
+    }
+}
+
+static void *sslRealloc(void *p, size_t size, const char *file, int line)
+{
+    if (!p) {
+        return sslMalloc(size, file, line);
+    } else if (!size) {
+        sslFree(p, file, line);
+        return nullptr;
+    }
+
+    size_t *block = (size_t *) p - 2, oldSize = *block;
+    if (!(block = (size_t *) realloc(block, size + 16))) {
+        return nullptr;
+    }
+    *block = size;
+    sslMemory += (long long) size - (long long) oldSize;
+    return block + 2;
+}
+#endif
+
+bool SSLContext::trackMemory()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    return CRYPTO_set_mem_functions(sslMalloc, sslRealloc, sslFree);
+#else
+    return false;
+#endif
+}
+
+long long SSLContext::getMemoryUsage()
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    return sslMemory;
+#else
+    return 0;
+#endif
 }
 
 SSLContext::SSLContext(std::string certChainFileName, std::string keyFileName)
@@ -329,6 +760,127 @@ SSLContext::~SSLContext()
     SSL_CTX_free(sslContext);
 }
 
+void SSLContext::setSessionCache(long size, long timeout)
+{
+    if (!size) {
+        SSL_CTX_set_session_cache_mode(sslContext, SSL_SESS_CACHE_OFF);
+        return;
+    }
+
+    static const unsigned char sessionIdContext[] = "uWS";
+    SSL_CTX_set_session_id_context(sslContext, sessionIdContext, sizeof(sessionIdContext) - 1);
+    SSL_CTX_set_session_cache_mode(sslContext, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(sslContext, size);
+    SSL_CTX_set_timeout(sslContext, timeout);
+}
+
+// the current and previous ticket keys of one SSL_CTX, rotated lazily by whichever thread issues a ticket first
+struct TicketKeys {
+    struct Key {
+        unsigned char name[16], aes[32], hmac[32];
+    } current, previous;
+    time_t created;
+    unsigned int rotation;
+    bool hasPrevious = false;
+    std::mutex mutex;
+
+    static int index;
+
+    void generate(Key &key) {
+        RAND_bytes(key.name, sizeof(key.name));
+        RAND_bytes(key.aes, sizeof(key.aes));
+        RAND_bytes(key.hmac, sizeof(key.hmac));
+    }
+
+    // the key to encrypt with (enc) or the one named by the ticket, 0 for none and 2 when the ticket should be renewed
+    int find(unsigned char *name, Key &key, bool enc) {
+        std::lock_guard<std::mutex> lock(mutex);
+        time_t now = time(nullptr);
+        if (now - created >= rotation) {
+            previous = current;
+            hasPrevious = now - created < 2 * (time_t) rotation;
+            generate(current);
+            created = now;
+        }
+
+        if (enc) {
+            memcpy(name, current.name, sizeof(current.name));
+            key = current;
+            return 1;
+        } else if (!memcmp(name, current.name, sizeof(current.name))) {
+            key = current;
+            return 1;
+        } else if (hasPrevious && !memcmp(name, previous.name, sizeof(previous.name))) {
+            key = previous;
+            return 2;
+        }
+        return 0;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static int callback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipherContext, EVP_MAC_CTX *macContext, int enc) {
+#else
+    static int callback(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cipherContext, HMAC_CTX *macContext, int enc) {
+#endif
+        TicketKeys *ticketKeys = (TicketKeys *) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), index);
+        Key key;
+        if (enc && RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) {
+            return -1;
+        }
+
+        int result = ticketKeys->find(name, key, enc);
+        if (!result) {
+            return 0;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac)),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *) "sha256", 0),
+            OSSL_PARAM_construct_end()
+        };
+        EVP_MAC_CTX_set_params(macContext, params);
+#else
+        HMAC_Init_ex(macContext, key.hmac, sizeof(key.hmac), EVP_sha256(), nullptr);
+#endif
+        if (enc) {
+            EVP_EncryptInit_ex(cipherContext, EVP_aes_256_cbc(), nullptr, key.aes, iv);
+        } else {
+            EVP_DecryptInit_ex(cipherContext, EVP_aes_256_cbc(), nullptr, key.aes, iv);
+        }
+        return result;
+    }
+};
+
+int TicketKeys::index = -1;
+
+void SSLContext::setTicketRotation(unsigned int rotation)
+{
+    static std::once_flag once;
+    std::call_once(once, []() {
+        TicketKeys::index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, [](void *parent, void *ptr, CRYPTO_EX_DATA *ad, int index, long argl, void *argp) {
+            delete (TicketKeys *) ptr;
+        });
+    });
+
+    TicketKeys *ticketKeys = (TicketKeys *) SSL_CTX_get_ex_data(sslContext, TicketKeys::index);
+    if (!ticketKeys) {
+        ticketKeys = new TicketKeys;
+        ticketKeys->generate(ticketKeys->current);
+        ticketKeys->created = time(nullptr);
+        SSL_CTX_set_ex_data(sslContext, TicketKeys::index, ticketKeys);
+    }
+
+    std::lock_guard<std::mutex> lock(ticketKeys->mutex);
+    ticketKeys->rotation = std::max<unsigned int>(rotation, 1);
+    SSL_CTX_clear_options(sslContext, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(sslContext, TicketKeys::callback);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(sslContext, TicketKeys::callback);
+#endif
+}
+
 void *SSLContext::newSSL(int fd)
 {
     SSL *ssl = SSL_new(sslContext);
@@ -4,6 +4,7 @@
 #include <mutex>
 #include <queue>
 #include <string>
+#include <vector>
 #include <functional>
 #include <uv.h>
 #include <openssl/ossl_typ.h>
@@ -11,9 +12,17 @@
 
 #include "WebSocket.h"
 #include "EventSystem.h"
+#include "HTTPParser.h"
+#include "HTTPResponse.h"
+#include "Metrics.h"
+
+struct PerMessageDeflate;
 
 namespace uWS {
 
+struct DeflateJob;
+class StaticFiles;
+
 enum Error {
     ERR_LISTEN,
     ERR_SSL,
@@ -25,7 +34,56 @@ enum Options : unsigned int {
     PERMESSAGE_DEFLATE = 1,
     SERVER_NO_CONTEXT_TAKEOVER = 2,
     CLIENT_NO_CONTEXT_TAKEOVER = 4,
-    NO_DELAY = 8
+    NO_DELAY = 8,
+    KERNEL_TLS = 16
+};
+
+struct CompressionPolicy {
+    size_t minSize = 64;
+    bool compressText = true;
+    bool compressBinary = true;
+
+    // a stream whose last sampleSize messages compressed worse than maxRatio is sent uncompressed for a while
+    unsigned int sampleSize = 16;
+    double maxRatio = 0.9;
+
+    // the level drops by one for every lagThreshold milliseconds of event loop lag
+    int level = Z_DEFAULT_COMPRESSION;
+    unsigned int lagThreshold = 10;
+
+    // messages at least this large are (de)compressed on the libuv thread pool, 0 keeps everything on the loop
+    size_t offloadSize = 0;
+
+    // past the shared inflate buffer a message may only grow to this many times its compressed size, 0 disables
+    unsigned int maxInflateRatio = 256;
+};
+
+struct CompressionStats {
+    unsigned long long messages = 0;
+    unsigned long long compressed = 0;
+    unsigned long long skippedSize = 0;
+    unsigned long long skippedOpCode = 0;
+    unsigned long long skippedRatio = 0;
+    // sent uncompressed while the socket's own stream was still deflating an offloaded message
+    unsigned long long skippedBusy = 0;
+    unsigned long long reducedLevel = 0;
+    unsigned long long bytesIn = 0;
+    unsigned long long bytesOut = 0;
+};
+
+// bytes held by the WebSockets of one server, by where they are held
+struct MemoryUsage {
+    unsigned long long sockets = 0;
+    unsigned long long poll = 0;
+    unsigned long long socketData = 0;
+    // queued frames, a prepared frame counts once for every socket still holding it
+    unsigned long long queue = 0;
+    // fragments being reassembled, packed TLS records and offloaded messages
+    unsigned long long buffers = 0;
+    // by zlib's own estimate, pooled streams only count while a socket holds them
+    unsigned long long zlib = 0;
+    // what the kernel charges for the send and receive queues (Linux only)
+    unsigned long long kernel = 0;
 };
 
 class WIN32_EXPORT SSLContext {
@@ -40,25 +98,54 @@ public:
         return sslContext;
     }
     void *newSSL(int fd);
+
+    // both are shared by every copy of this context, so by every thread using it
+    // sessions resumed by id from a cache of size entries, 0 turns the cache off
+    void setSessionCache(long size, long timeout = 300);
+    // stateless resumption with ticket keys replaced every rotation seconds, the previous key is still accepted
+    void setTicketRotation(unsigned int rotation);
+
+    // counts everything OpenSSL allocates from here on, false if it already allocated before the call
+    static bool trackMemory();
+    // bytes OpenSSL holds across the process, 0 unless tracked
+    static long long getMemoryUsage();
 };
 
 class WIN32_EXPORT Server
 {
     friend class HTTPSocket;
+    friend class ClientSocket;
+    friend class EventSystem;
     friend class WebSocket;
+    friend struct Backlog;
+    friend struct DeflateJob;
 private:
     uv_loop_t *loop;
     uv_poll_t *listenPoll = nullptr, *clients = nullptr;
     uv_async_t upgradeAsync, closeAsync;
     sockaddr_in listenAddr;
-    z_stream writeStream;
     bool master, forceClose;
     unsigned int options, maxPayload;
+    CompressionPolicy compressionPolicy;
+    CompressionStats compressionStats;
+    int serverMaxWindowBits = 15, clientMaxWindowBits = 15, memLevel = MAX_MEM_LEVEL;
     SSLContext sslContext;
     EventSystem &es;
     static void acceptHandler(uv_poll_t *p, int status, int events);
     static void upgradeHandler(Server *server);
     static void closeHandler(Server *server);
+    bool shouldCompress(PerMessageDeflate *pmd, size_t length, OpCode opCode);
+    int compressionLevel();
+    void recordCompression(PerMessageDeflate *pmd, size_t length, size_t compressedLength);
+    size_t inflateLimit(size_t compressedLength);
+    WebSocket::PreparedMessage *prepareCompressed(char *data, size_t length, OpCode opCode);
+
+    Metrics metrics;
+    std::string metricsPath;
+    std::vector<Server *> metricsServers;
+    bool matchMetrics(HTTPRequest &request);
+    std::string metricsResponse();
+    void deliverMessage(WebSocket webSocket, char *message, size_t length, OpCode opCode);
 
     char *recvBuffer, *sendBuffer, *inflateBuffer, *upgradeBuffer;
     static const int LARGE_BUFFER_SIZE = 307200;
@@ -84,18 +171,51 @@ private:
         }
     };
 
+    class Multicast {
+        Server *server;
+        char *data;
+        size_t length;
+        OpCode opCode;
+        WebSocket::PreparedMessage *preparedMessage = nullptr, *preparedCompressedMessage = nullptr;
+        DeflateJob *deflateJob = nullptr;
+        bool uncompressible = false;
+    public:
+        Multicast(Server *server, char *data, size_t length, OpCode opCode) : server(server), data(data), length(length), opCode(opCode) {}
+        ~Multicast();
+        void send(WebSocket webSocket);
+    };
+
     struct UpgradeRequest {
         uv_os_sock_t fd;
         std::string secKey;
         void *ssl;
         std::string extensions;
+        std::string buffered;
     };
 
     std::queue<UpgradeRequest> upgradeQueue;
+    std::queue<std::pair<uv_os_sock_t, void *>> adoptQueue;
     std::mutex upgradeQueueMutex;
 
-    std::function<void(uv_os_sock_t, const char *, void *, const char *, size_t)> upgradeCallback;
+    struct Route {
+        std::string prefix;
+        std::vector<Server *> targets;
+        unsigned int next;
+    };
+
+    std::vector<Route> routes;
+    Server *match(HTTPRequest &request);
+
+    std::vector<StaticFiles *> staticFiles;
+    StaticFiles *matchStatic(HTTPRequest &request);
+
+    std::function<void(uv_os_sock_t, void *)> acceptCallback;
+    std::function<void(unsigned long long, bool)> handshakeCallback;
+    std::function<void(uv_os_sock_t, const char *, void *, const char *, size_t, const char *, size_t, HTTPRequest)> upgradeCallback;
+    std::function<void(HTTPResponse, HTTPRequest, char *, size_t)> httpRequestCallback;
+    std::function<void(HTTPResponse)> httpDisconnectionCallback;
     std::function<void(WebSocket)> connectionCallback;
+    std::function<void(void *)> connectionErrorCallback;
     std::function<void(WebSocket, int code, char *message, size_t length)> disconnectionCallback;
     std::function<void(WebSocket, char *, size_t, OpCode)> messageCallback;
     std::function<void(WebSocket, char *, size_t)> pingCallback;
@@ -105,17 +225,57 @@ public:
     ~Server();
     Server(const Server &server) = delete;
     Server &operator=(const Server &server) = delete;
-    void onUpgrade(std::function<void(uv_os_sock_t, const char *, void *, const char *, size_t)> upgradeCallback);
+    void onAccept(std::function<void(uv_os_sock_t, void *)> acceptCallback);
+    void onHandshake(std::function<void(unsigned long long nanoseconds, bool resumed)> handshakeCallback);
+    void onUpgrade(std::function<void(uv_os_sock_t, const char *, void *, const char *, size_t, const char *, size_t, HTTPRequest)> upgradeCallback);
+    void onHttpRequest(std::function<void(HTTPResponse, HTTPRequest, char *, size_t)> httpRequestCallback);
+    void onHttpDisconnection(std::function<void(HTTPResponse)> httpDisconnectionCallback);
     void onConnection(std::function<void(WebSocket)> connectionCallback);
+    void onConnectionError(std::function<void(void *user)> connectionErrorCallback);
     void onDisconnection(std::function<void(WebSocket, int code, char *message, size_t length)> disconnectionCallback);
     void onMessage(std::function<void(WebSocket, char *, size_t, OpCode)> messageCallback);
     void onPing(std::function<void(WebSocket, char *, size_t)> pingCallback);
     void onPong(std::function<void(WebSocket, char *, size_t)> pongCallback);
     void close(bool force = false);
-    void upgrade(uv_os_sock_t fd, const char *secKey, void *ssl = nullptr, const char *extensions = nullptr, size_t extensionsLength = 0);
-    size_t compress(char *src, size_t srcLength, char *dst);
+    // buffered holds whatever the client sent after its request head and is parsed as soon as the socket is up
+    void upgrade(uv_os_sock_t fd, const char *secKey, void *ssl = nullptr, const char *extensions = nullptr, size_t extensionsLength = 0, const char *buffered = nullptr, size_t bufferedLength = 0);
+    // a freshly accepted connection whose HTTP (and TLS) handshake runs on this server's thread
+    void adopt(uv_os_sock_t fd, void *ssl = nullptr);
+    void route(std::string prefix, std::vector<Server *> targets);
+    void serve(std::string prefix, std::string directory);
+    size_t compress(char *src, size_t srcLength, char *dst, size_t dstLength = LARGE_BUFFER_SIZE);
+    void setCompressionPolicy(CompressionPolicy compressionPolicy);
+    CompressionStats getCompressionStats();
+    void setCompressionMemory(int serverMaxWindowBits, int clientMaxWindowBits, int memLevel);
+    // walks every WebSocket, so only from this server's thread
+    MemoryUsage getMemoryUsage();
+    // counters of this server, from any thread
+    MetricsSnapshot getMetrics();
+    // GET path answers with the Prometheus text of this server and servers (typically its workers)
+    void exportMetrics(std::string path, std::vector<Server *> servers = {});
     void broadcast(char *data, size_t length, OpCode opCode);
 
+    // serializes (and compresses) the message at most once for any number of receivers
+    template <class Iterator>
+    void multicast(Iterator first, Iterator last, char *data, size_t length, OpCode opCode)
+    {
+        Multicast multicast(this, data, length, opCode);
+        for (; first != last; ++first) {
+            multicast.send(*first);
+        }
+    }
+
+    template <class Predicate>
+    void multicast(char *data, size_t length, OpCode opCode, Predicate predicate)
+    {
+        Multicast multicast(this, data, length, opCode);
+        for (WebSocket webSocket = clients; webSocket; webSocket = webSocket.next()) {
+            if (predicate(webSocket)) {
+                multicast.send(webSocket);
+            }
+        }
+    }
+
     WebSocketIterator begin() {
         return WebSocketIterator(clients);
     }
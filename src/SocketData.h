@@ -1,16 +1,41 @@
 #ifndef SOCKETDATA_H
 #define SOCKETDATA_H
 
+#include <string>
+#include <vector>
 #include <openssl/ssl.h>
 
+struct PerMessageDeflate;
+
 namespace uWS {
 
 class Server;
+struct Backlog;
+
+// once the kernel does the record layer of a direction OpenSSL is no longer needed for it
+inline bool kernelSend(SSL *ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl));
+#else
+    return false;
+#endif
+}
+
+inline bool kernelRecv(SSL *ssl)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    return ssl && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+    return false;
+#endif
+}
 
 enum SendFlags {
     SND_CONTINUATION = 1,
     SND_NO_FIN = 2,
-    SND_COMPRESSED = 64
+    SND_COMPRESSED = 64,
+    SND_MASKED = 128
 };
 
 enum SocketState : int {
@@ -21,7 +46,8 @@ enum SocketState : int {
 
 enum SocketSendState : int {
     FRAGMENT_START,
-    FRAGMENT_MID
+    FRAGMENT_MID,
+    FRAGMENT_MID_COMPRESSED
 };
 
 struct SocketData {
@@ -74,8 +100,21 @@ struct SocketData {
     uv_poll_t *next = nullptr, *prev = nullptr;
     void *data = nullptr;
     SSL *ssl = nullptr;
+    bool kernelSend = false, kernelRecv = false;
+    // our end connected, frames out are masked and frames in are not
+    bool client = false;
     PerMessageDeflate *pmd = nullptr;
+    Backlog *backlog = nullptr;
+    bool midMessage = false, collecting = false;
     std::string buffer, controlBuffer;
+
+    // small TLS frames of this loop iteration, packed into as few records as possible
+    struct Records {
+        static const size_t RECORD_SIZE = 16384;
+        std::string data;
+        std::vector<std::pair<void (*)(WebSocket, void *, bool), void *>> callbacks;
+    } *records = nullptr;
+    bool corked = false;
 };
 
 }
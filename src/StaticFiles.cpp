@@ -0,0 +1,253 @@
+#include "StaticFiles.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace uWS {
+
+static const char *contentType(const std::string &path)
+{
+    static const char *types[][2] = {
+        {".html", "text/html; charset=utf-8"},
+        {".js", "application/javascript"},
+        {".css", "text/css"},
+        {".json", "application/json"},
+        {".map", "application/json"},
+        {".wasm", "application/wasm"},
+        {".svg", "image/svg+xml"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".ico", "image/x-icon"},
+        {".woff2", "font/woff2"},
+        {".txt", "text/plain; charset=utf-8"}
+    };
+
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos) {
+        for (auto &type : types) {
+            if (!path.compare(dot, std::string::npos, type[0])) {
+                return type[1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+Asset *Asset::load(const std::string &path, const char *contentType, bool gzipped, bool vary)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    Asset *asset = new Asset;
+    asset->path = path;
+    asset->fd = fd;
+    asset->size = st.st_size;
+    asset->mtime = st.st_mtime;
+
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%lx-%lx%s\"", (unsigned long) st.st_mtime, (unsigned long) st.st_size, gzipped ? "-gz" : "");
+    asset->etag = etag;
+    asset->headers = "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(asset->size) + "\r\nContent-Type: " + contentType + "\r\nETag: " + etag + "\r\n";
+    if (gzipped) {
+        asset->headers += "Content-Encoding: gzip\r\n";
+    }
+    if (vary) {
+        asset->headers += "Vary: Accept-Encoding\r\n";
+    }
+    asset->headers += "\r\n";
+
+    // small files are read in right behind their headers so the whole response is one buffer, unlike a mapping
+    // a copy cannot fault when the file is truncated underneath it
+    if (asset->size && asset->size <= StaticFiles::MEMORY_LIMIT) {
+        size_t headLength = asset->headers.length();
+        char *response = new char[headLength + asset->size];
+        memcpy(response, asset->headers.data(), headLength);
+
+        size_t offset = 0;
+        while (offset < asset->size) {
+            ssize_t length = pread(fd, response + headLength + offset, asset->size - offset, offset);
+            if (length <= 0) {
+                break;
+            }
+            offset += length;
+        }
+
+        // a file that shrank meanwhile is left to sendfile, which ends the response when it runs short
+        if (offset == asset->size) {
+            asset->response = response;
+            asset->responseLength = headLength + asset->size;
+            ::close(fd);
+            asset->fd = -1;
+        } else {
+            delete [] response;
+        }
+    }
+
+    return asset;
+}
+
+void Asset::release()
+{
+    if (--references) {
+        return;
+    }
+
+    if (gzip) {
+        gzip->release();
+    }
+    delete [] response;
+    if (fd != -1) {
+        ::close(fd);
+    }
+    delete this;
+}
+
+StaticFiles::StaticFiles(std::string prefix, std::string root) : prefix(prefix), root(root)
+{
+    if (this->prefix.length() && this->prefix.back() == '/') {
+        this->prefix.pop_back();
+    }
+    if (this->root.length() > 1 && this->root.back() == '/') {
+        this->root.pop_back();
+    }
+}
+
+StaticFiles::~StaticFiles()
+{
+    for (auto &asset : assets) {
+        asset.second->release();
+    }
+}
+
+static bool equalsLower(const char *data, size_t length, const char *lower)
+{
+    if (length != strlen(lower)) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if ((data[i] | 32) != lower[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// an Accept-Encoding value lists codings with optional ;q= weights, gzip counts when it or * is listed with a weight above 0
+bool StaticFiles::acceptsGzip(const char *value, size_t length)
+{
+    int gzip = -1, wildcard = -1;
+    const char *end = value + length;
+    while (value < end) {
+        const char *element = value, *elementEnd = std::find(value, end, ',');
+        value = elementEnd + (elementEnd < end);
+
+        // the coding and then its parameters, all with optional whitespace around
+        bool accepted = true;
+        const char *coding = nullptr;
+        size_t codingLength = 0;
+        while (element < elementEnd) {
+            const char *parameterEnd = std::find(element, elementEnd, ';');
+            const char *first = element, *last = parameterEnd;
+            element = parameterEnd + (parameterEnd < elementEnd);
+            while (first < last && (*first == ' ' || *first == '\t')) {
+                first++;
+            }
+            while (last > first && (last[-1] == ' ' || last[-1] == '\t')) {
+                last--;
+            }
+
+            if (!coding) {
+                coding = first;
+                codingLength = last - first;
+            } else if (last - first >= 2 && (first[0] | 32) == 'q' && first[1] == '=') {
+                // 0, 0. and 0.000 are all zero, anything else is a weight above it
+                accepted = false;
+                for (const char *digit = first + 2; digit < last; digit++) {
+                    accepted |= *digit >= '1' && *digit <= '9';
+                }
+            }
+        }
+
+        if (coding && equalsLower(coding, codingLength, "gzip")) {
+            gzip = accepted;
+        } else if (coding && equalsLower(coding, codingLength, "*")) {
+            wildcard = accepted;
+        }
+    }
+    return gzip != -1 ? gzip : wildcard == 1;
+}
+
+// GET and HEAD below the prefix, on whole path segments
+bool StaticFiles::matches(HTTPRequest &request)
+{
+    if (!(request.methodLength == 3 && !memcmp(request.method, "GET", 3)) && !(request.methodLength == 4 && !memcmp(request.method, "HEAD", 4))) {
+        return false;
+    }
+
+    unsigned int pathLength = request.getPathLength();
+    return pathLength >= prefix.length() && !memcmp(request.url, prefix.data(), prefix.length())
+            && (pathLength == prefix.length() || request.url[prefix.length()] == '/');
+}
+
+// nullptr when there is no such file, a changed file is reopened while responses in flight keep the old one
+Asset *StaticFiles::get(HTTPRequest &request, uint64_t now)
+{
+    std::string path(request.url + prefix.length(), request.getPathLength() - prefix.length());
+    if (path.empty() || path[0] != '/') {
+        path.insert(0, "/");
+    }
+    if (path.back() == '/') {
+        path += "index.html";
+    }
+
+    // nothing outside of root
+    if (path.find("/../") != std::string::npos || (path.length() >= 3 && !path.compare(path.length() - 3, 3, "/.."))) {
+        return nullptr;
+    }
+
+    auto it = assets.find(path);
+    if (it != assets.end()) {
+        Asset *asset = it->second;
+        if (now - asset->checked < REVALIDATE) {
+            return asset;
+        }
+
+        struct stat st;
+        if (!stat(asset->path.c_str(), &st) && st.st_mtime == asset->mtime && (size_t) st.st_size == asset->size) {
+            asset->checked = now;
+            return asset;
+        }
+        asset->release();
+        assets.erase(it);
+    }
+
+    // a precompressed .gz next to the file is picked up with it
+    const char *type = contentType(path);
+    Asset *gzip = Asset::load(root + path + ".gz", type, true, true);
+    Asset *asset = Asset::load(root + path, type, false, gzip);
+    if (!asset) {
+        if (gzip) {
+            gzip->release();
+        }
+        return nullptr;
+    }
+
+    asset->gzip = gzip;
+    asset->checked = now;
+    assets[path] = asset;
+    return asset;
+}
+
+}
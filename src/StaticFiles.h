@@ -0,0 +1,50 @@
+#ifndef STATICFILES_H
+#define STATICFILES_H
+
+#include <map>
+#include <string>
+#include <cstdint>
+#include <ctime>
+
+#include "HTTPParser.h"
+
+namespace uWS {
+
+// one file on disk with its 200 response head built once, shared by every response still sending it
+struct Asset {
+    std::string path, headers, etag;
+    int fd = -1;
+    size_t size = 0;
+    time_t mtime = 0;
+    uint64_t checked = 0;
+
+    // small files: headers followed by a copy of the file, sent as one prebuilt response
+    char *response = nullptr;
+    size_t responseLength = 0;
+
+    Asset *gzip = nullptr;
+    unsigned int references = 1;
+
+    static Asset *load(const std::string &path, const char *contentType, bool gzipped, bool vary);
+    void release();
+};
+
+// a directory served below a url prefix, assets stay open and are revalidated at most once a second
+class StaticFiles {
+    std::string prefix, root;
+    std::map<std::string, Asset *> assets;
+
+public:
+    static const size_t MEMORY_LIMIT = 65536;
+    static const uint64_t REVALIDATE = 1000;
+
+    StaticFiles(std::string prefix, std::string root);
+    ~StaticFiles();
+    bool matches(HTTPRequest &request);
+    Asset *get(HTTPRequest &request, uint64_t now);
+    static bool acceptsGzip(const char *value, size_t length);
+};
+
+}
+
+#endif // STATICFILES_H
@@ -4,6 +4,7 @@
 #include "Extensions.h"
 #include "SocketData.h"
 #include "Parser.h"
+#include "Offload.h"
 
 #include <iostream>
 #include <algorithm>
@@ -11,48 +12,79 @@
 
 namespace uWS {
 
-inline size_t formatMessage(char *dst, const char *src, size_t length, OpCode opCode, size_t reportedLength, bool compressed)
+void WebSocket::send(const char *message, size_t length, OpCode opCode, void (*callback)(WebSocket webSocket, void *data, bool cancelled), void *callbackData, size_t fakedLength)
 {
-    size_t messageLength;
-    if (reportedLength < 126) {
-        messageLength = length + 2;
-        memcpy(dst + 2, src, length);
-        dst[1] = reportedLength;
-    } else if (reportedLength <= UINT16_MAX) {
-        messageLength = length + 4;
-        memcpy(dst + 4, src, length);
-        dst[1] = 126;
-        *((uint16_t *) &dst[2]) = htons(reportedLength);
-    } else {
-        messageLength = length + 10;
-        memcpy(dst + 10, src, length);
-        dst[1] = 127;
-        *((uint64_t *) &dst[2]) = htobe64(reportedLength);
+    size_t reportedLength = length;
+    if (fakedLength) {
+        reportedLength = fakedLength;
     }
 
-    int flags = 0;
-    dst[0] = (flags & SND_NO_FIN ? 0 : 128) | (compressed ? SND_COMPRESSED : 0);
-    if (!(flags & SND_CONTINUATION)) {
-        dst[0] |= opCode;
+    SocketData *socketData = (SocketData *) p->data;
+    socketData->server->metrics.sent(opCode, reportedLength);
+    if (socketData->pmd && opCode < 3 && !fakedLength && socketData->server->shouldCompress(socketData->pmd, length, opCode)) {
+        size_t offloadSize = socketData->server->compressionPolicy.offloadSize;
+        if (offloadSize && length >= offloadSize && !socketData->client) {
+            DeflateJob *deflateJob = new DeflateJob(socketData->server, message, length, opCode, socketData->pmd);
+            deflateJob->callback = callback;
+            deflateJob->callbackData = callbackData;
+            deflateJob->addReceiver(p);
+            deflateJob->submit();
+            return;
+        }
+
+        bool sent = sendCompressed(message, length, opCode, 0, socketData->pmd->acquireWriteStream(), socketData->server->compressionLevel(), callback, callbackData);
+        socketData->pmd->releaseWriteStream();
+        if (!sent) {
+            close(true, 1006);
+        }
+        return;
     }
-    return messageLength;
+
+    sendFrame(message, length, opCode, reportedLength, socketData->client ? SND_MASKED : 0, callback, callbackData);
 }
 
-void WebSocket::send(const char *message, size_t length, OpCode opCode, void (*callback)(WebSocket webSocket, void *data, bool cancelled), void *callbackData, size_t fakedLength)
+// one uncompressed frame, small ones are formatted in the shared send buffer
+void WebSocket::sendFrame(const char *message, size_t length, OpCode opCode, size_t reportedLength, int flags, void (*callback)(WebSocket, void *, bool), void *callbackData)
 {
-    size_t reportedLength = length;
-    if (fakedLength) {
-        reportedLength = fakedLength;
+    SocketData *socketData = (SocketData *) p->data;
+    if (length <= Server::SHORT_BUFFER_SIZE - 14) {
+        char *sendBuffer = socketData->server->sendBuffer;
+        write(sendBuffer, formatMessage(sendBuffer, message, length, opCode, reportedLength, flags & SND_COMPRESSED, flags), false, callback, callbackData);
+    } else {
+        char *buffer = new char[sizeof(SocketData::Queue::Message) + length + 14] + sizeof(SocketData::Queue::Message);
+        write(buffer, formatMessage(buffer, message, length, opCode, reportedLength, flags & SND_COMPRESSED, flags), true, callback, callbackData);
+    }
+}
+
+// deflates behind room for the header, then moves the payload in place once its length is known
+bool WebSocket::sendCompressed(const char *message, size_t length, OpCode opCode, int flags, void *stream, int level, void (*callback)(WebSocket, void *, bool), void *callbackData)
+{
+    SocketData *socketData = (SocketData *) p->data;
+    size_t bound = deflateBound((z_stream *) stream, length) + 16;
+    bool fin = !(flags & SND_NO_FIN), compressed = !(flags & SND_CONTINUATION);
+    if (socketData->client) {
+        flags |= SND_MASKED;
     }
 
-    if (length <= Server::SHORT_BUFFER_SIZE - 10) {
-        SocketData *socketData = (SocketData *) p->data;
+    if (bound <= Server::SHORT_BUFFER_SIZE - 14) {
         char *sendBuffer = socketData->server->sendBuffer;
-        write(sendBuffer, formatMessage(sendBuffer, message, length, opCode, reportedLength, false), false, callback, callbackData);
+        size_t compressedLength = PerMessageDeflate::deflate((z_stream *) stream, (char *) message, length, sendBuffer + 14, bound, fin, level);
+        if (!compressedLength) {
+            return false;
+        }
+        socketData->server->recordCompression(socketData->pmd, length, compressedLength);
+        write(sendBuffer, formatMessage(sendBuffer, sendBuffer + 14, compressedLength, opCode, compressedLength, compressed, flags), false, callback, callbackData);
     } else {
-        char *buffer = new char[sizeof(SocketData::Queue::Message) + length + 10] + sizeof(SocketData::Queue::Message);
-        write(buffer, formatMessage(buffer, message, length, opCode, reportedLength, false), true, callback, callbackData);
+        size_t compressedLength;
+        char *buffer = PerMessageDeflate::deflate((z_stream *) stream, message, length, sizeof(SocketData::Queue::Message) + 14, compressedLength, fin, level);
+        if (!buffer) {
+            return false;
+        }
+        buffer += sizeof(SocketData::Queue::Message);
+        socketData->server->recordCompression(socketData->pmd, length, compressedLength);
+        write(buffer, formatMessage(buffer, buffer + 14, compressedLength, opCode, compressedLength, compressed, flags), true, callback, callbackData);
     }
+    return true;
 }
 
 void WebSocket::ping(const char *message, size_t length)
@@ -60,10 +92,34 @@ void WebSocket::ping(const char *message, size_t length)
     send(message, length, OpCode::PING);
 }
 
+// compressed fragments become real continuation frames since their final length is unknown up front, so do those of clients as each frame has its own mask
 void WebSocket::sendFragment(char *data, size_t length, OpCode opCode, size_t remainingBytes)
 {
     SocketData *socketData = (SocketData *) p->data;
-    if (remainingBytes) {
+    if (socketData->sendState == FRAGMENT_START && remainingBytes && socketData->pmd && opCode < 3
+            && socketData->server->shouldCompress(socketData->pmd, length + remainingBytes, opCode)) {
+        socketData->server->metrics.sent(opCode, length + remainingBytes);
+        if (!sendCompressed(data, length, opCode, SND_NO_FIN, socketData->pmd->acquireWriteStream(), socketData->server->compressionLevel())) {
+            close(true, 1006);
+            return;
+        }
+        socketData->sendState = FRAGMENT_MID_COMPRESSED;
+    } else if (socketData->sendState == FRAGMENT_MID_COMPRESSED) {
+        if (!sendCompressed(data, length, opCode, SND_CONTINUATION | (remainingBytes ? SND_NO_FIN : 0), socketData->pmd->writeStream, socketData->server->compressionLevel())) {
+            close(true, 1006);
+            return;
+        }
+        if (!remainingBytes) {
+            socketData->pmd->releaseWriteStream();
+            socketData->sendState = FRAGMENT_START;
+        }
+    } else if (socketData->client) {
+        if (socketData->sendState == FRAGMENT_START) {
+            socketData->server->metrics.sent(opCode, length + remainingBytes);
+        }
+        sendFrame(data, length, opCode, length, SND_MASKED | (socketData->sendState == FRAGMENT_MID ? SND_CONTINUATION : 0) | (remainingBytes ? SND_NO_FIN : 0));
+        socketData->sendState = remainingBytes ? FRAGMENT_MID : FRAGMENT_START;
+    } else if (remainingBytes) {
         if (socketData->sendState == FRAGMENT_START) {
             send(data, length, opCode, nullptr, nullptr, length + remainingBytes);
             socketData->sendState = FRAGMENT_MID;
@@ -89,8 +145,27 @@ WebSocket::PreparedMessage *WebSocket::prepareMessage(char *data, size_t length,
     return preparedMessage;
 }
 
+// counted by what is framed, a compressed frame by its compressed payload
 void WebSocket::sendPrepared(WebSocket::PreparedMessage *preparedMessage)
 {
+    char *frame = preparedMessage->buffer;
+    size_t headerLength = (frame[1] & 127) < 126 ? 2 : ((frame[1] & 127) == 126 ? 4 : 10);
+    ((SocketData *) p->data)->server->metrics.sent((OpCode) (frame[0] & 15), preparedMessage->length - headerLength);
+    writePrepared(preparedMessage);
+}
+
+void WebSocket::writePrepared(WebSocket::PreparedMessage *preparedMessage)
+{
+    // prepared frames are unmasked, a client sends a masked copy
+    SocketData *socketData = (SocketData *) p->data;
+    if (socketData->client) {
+        char *frame = preparedMessage->buffer;
+        size_t headerLength = (frame[1] & 127) < 126 ? 2 : ((frame[1] & 127) == 126 ? 4 : 10);
+        sendFrame(frame + headerLength, preparedMessage->length - headerLength, (OpCode) (frame[0] & 15), preparedMessage->length - headerLength,
+                  SND_MASKED | (frame[0] & SND_COMPRESSED) | (frame[0] & 128 ? 0 : SND_NO_FIN) | (frame[0] & 15 ? 0 : SND_CONTINUATION));
+        return;
+    }
+
     preparedMessage->references++;
     write(preparedMessage->buffer, preparedMessage->length, false, [](WebSocket webSocket, void *userData, bool cancelled) {
         PreparedMessage *preparedMessage = (PreparedMessage *) userData;
@@ -116,32 +191,56 @@ void WebSocket::handleFragment(const char *fragment, size_t length, OpCode opCod
     // Text or binary
     if (opCode < 3) {
 
-        // permessage-deflate
+        // large compressed messages and everything behind them are collected whole and delivered in order
+        if (!socketData->midMessage) {
+            size_t offloadSize = socketData->server->compressionPolicy.offloadSize;
+            socketData->collecting = socketData->backlog || (compressed && offloadSize && length + remainingBytes >= offloadSize);
+        }
+        socketData->midMessage = remainingBytes || !fin;
+
+        if (socketData->collecting) {
+            if (socketData->server->maxPayload && length + socketData->buffer.length() > socketData->server->maxPayload) {
+                close(true, 1006);
+                return;
+            }
+
+            socketData->buffer.append(fragment, length);
+            if (!socketData->midMessage) {
+                std::string message;
+                message.swap(socketData->buffer);
+                Backlog::push(p, {std::move(message), opCode, compressed});
+            }
+            return;
+        }
+
+        // permessage-deflate, a whole message that fits goes to the shared buffer and anything else straight into the message buffer
         if (compressed) {
+            Server *server = socketData->server;
+            bool last = !remainingBytes && fin, full = true;
+            size_t buffered = socketData->buffer.length();
+            server->metrics.inflateIn.add(length);
             socketData->pmd->setInput((char *) fragment, length);
-            size_t bufferSpace;
             try {
-                while (!(bufferSpace = socketData->pmd->inflate(socketData->server->inflateBuffer, Server::LARGE_BUFFER_SIZE))) {
-                    socketData->buffer.append(socketData->server->inflateBuffer, Server::LARGE_BUFFER_SIZE);
-                }
-
-                if (!remainingBytes && fin) {
-                    unsigned char tail[4] = {0, 0, 255, 255};
-                    socketData->pmd->setInput((char *) tail, 4);
-                    if (!socketData->pmd->inflate(socketData->server->inflateBuffer + Server::LARGE_BUFFER_SIZE - bufferSpace, bufferSpace)) {
-                        socketData->buffer.append(socketData->server->inflateBuffer + Server::LARGE_BUFFER_SIZE - bufferSpace, bufferSpace);
-                        while (!(bufferSpace = socketData->pmd->inflate(socketData->server->inflateBuffer, Server::LARGE_BUFFER_SIZE))) {
-                            socketData->buffer.append(socketData->server->inflateBuffer, Server::LARGE_BUFFER_SIZE);
-                        }
+                if (last && !socketData->buffer.length()) {
+                    length = socketData->pmd->inflate(server->inflateBuffer, Server::LARGE_BUFFER_SIZE, true, full);
+                    if (full) {
+                        socketData->buffer.append(server->inflateBuffer, length);
                     }
                 }
+                if (full) {
+                    socketData->pmd->inflate(socketData->buffer, last, server->inflateLimit(socketData->pmd->messageIn));
+                    length = 0;
+                }
             } catch (...) {
                 close(true, 1006);
                 return;
             }
 
-            fragment = socketData->server->inflateBuffer;
-            length = Server::LARGE_BUFFER_SIZE - bufferSpace;
+            if (last) {
+                socketData->pmd->releaseReadStream();
+            }
+            server->metrics.inflateOut.add(socketData->buffer.length() - buffered + length);
+            fragment = server->inflateBuffer;
         }
 
         if (!remainingBytes && fin && !socketData->buffer.length()) {
@@ -150,7 +249,7 @@ void WebSocket::handleFragment(const char *fragment, size_t length, OpCode opCod
                 return;
             }
 
-            socketData->server->messageCallback(p, (char *) fragment, length, opCode);
+            socketData->server->deliverMessage(p, (char *) fragment, length, opCode);
         } else {
             if (socketData->server->maxPayload && length + socketData->buffer.length() > socketData->server->maxPayload) {
                 close(true, 1006);
@@ -166,14 +265,21 @@ void WebSocket::handleFragment(const char *fragment, size_t length, OpCode opCod
                     return;
                 }
 
-                socketData->server->messageCallback(p, (char *) socketData->buffer.c_str(), socketData->buffer.length(), opCode);
+                socketData->server->deliverMessage(p, (char *) socketData->buffer.c_str(), socketData->buffer.length(), opCode);
                 socketData->buffer.clear();
             }
         }
     } else {
         socketData->controlBuffer.append(fragment, length);
         if (!remainingBytes && fin) {
+            socketData->server->metrics.received(opCode, socketData->controlBuffer.length());
             if (opCode == CLOSE) {
+                if (socketData->backlog) {
+                    Backlog::push(p, {socketData->controlBuffer, CLOSE, false});
+                    socketData->controlBuffer.clear();
+                    return;
+                }
+
                 std::tuple<unsigned short, char *, size_t> closeFrame = Parser::parseCloseFrame(socketData->controlBuffer);
                 close(false, std::get<0>(closeFrame), std::get<1>(closeFrame), std::get<2>(closeFrame));
                 // leave the controlBuffer with the close frame intact
@@ -218,6 +324,8 @@ WebSocket::Address WebSocket::getAddress()
 void WebSocket::onReadable(uv_poll_t *p, int status, int events)
 {
     SocketData *socketData = (SocketData *) p->data;
+    EventSystem &es = socketData->server->es;
+    es.event();
 
     // this one is not needed, read will do this!
     if (status < 0) {
@@ -232,7 +340,15 @@ void WebSocket::onReadable(uv_poll_t *p, int status, int events)
 
     // this whole SSL part should be shared with HTTPSocket
     ssize_t received;
-    if (socketData->ssl) {
+    bool useSSL = socketData->ssl && !socketData->kernelRecv;
+    if (!useSSL) {
+        received = recv(fd, src + socketData->spillLength, Server::LARGE_BUFFER_SIZE - socketData->spillLength, 0);
+
+        // the kernel only hands out application data, any other record is left to OpenSSL
+        useSSL = received == SOCKET_ERROR && socketData->kernelRecv && errno == EIO;
+    }
+
+    if (useSSL) {
         received = SSL_read(socketData->ssl, src + socketData->spillLength, Server::LARGE_BUFFER_SIZE - socketData->spillLength);
 
         // do not treat SSL_ERROR_WANT_* as hang ups
@@ -243,8 +359,6 @@ void WebSocket::onReadable(uv_poll_t *p, int status, int events)
                 return;
             }
         }
-    } else {
-        received = recv(fd, src + socketData->spillLength, Server::LARGE_BUFFER_SIZE - socketData->spillLength, 0);
     }
 
     if (received == SOCKET_ERROR || received == 0) {
@@ -272,7 +386,13 @@ void WebSocket::onReadable(uv_poll_t *p, int status, int events)
     setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(int));
 #endif
 
-    Parser::consume(socketData->spillLength + received, src, socketData, p);
+    uint64_t start = uv_hrtime();
+    if (socketData->client) {
+        Parser::consume<false>(socketData->spillLength + received, src, socketData, p);
+    } else {
+        Parser::consume(socketData->spillLength + received, src, socketData, p);
+    }
+    es.record(LOOP_PARSE, p, uv_hrtime() - start);
 
 #ifdef __linux
     cork = 0;
@@ -280,8 +400,38 @@ void WebSocket::onReadable(uv_poll_t *p, int status, int events)
 #endif
 }
 
+// bytes read before the socket became a WebSocket, parsed in pieces no larger than the receive buffer
+void WebSocket::consumeBuffered(const char *data, size_t length)
+{
+    // a forced close in onConnection already deleted socketData, so the handle is checked before it is touched
+    if (!length || uv_is_closing((uv_handle_t *) p)) {
+        return;
+    }
+
+    SocketData *socketData = (SocketData *) p->data;
+    char *src = socketData->server->recvBuffer;
+    // and again after every piece since the callbacks can force a close too
+    while (length && !uv_is_closing((uv_handle_t *) p) && socketData->state != CLOSING) {
+        size_t chunk = std::min<size_t>(length, Server::LARGE_BUFFER_SIZE - socketData->spillLength);
+        memcpy(src, socketData->spill, socketData->spillLength);
+        memcpy(src + socketData->spillLength, data, chunk);
+        if (socketData->client) {
+            Parser::consume<false>(socketData->spillLength + chunk, src, socketData, p);
+        } else {
+            Parser::consume(socketData->spillLength + chunk, src, socketData, p);
+        }
+        data += chunk;
+        length -= chunk;
+    }
+}
+
 void WebSocket::onWritableReadable(uv_poll_t *handle, int status, int events)
 {
+    // onReadable counts itself
+    if (!(events & UV_READABLE)) {
+        ((SocketData *) handle->data)->server->es.event();
+    }
+
     // handle all poll errors with forced disconnection
     if (status < 0) {
         WebSocket(handle).close(true, 1006);
@@ -306,33 +456,57 @@ void WebSocket::onWritableReadable(uv_poll_t *handle, int status, int events)
         }
     }
 
+    // only receive when we have fully sent everything
+    size_t flushed = 0;
+    uint64_t start = uv_hrtime();
+    bool empty = flushQueue(handle, socketData->kernelSend ? nullptr : socketData->ssl, &socketData->messageQueue, &flushed);
+    socketData->server->es.record(LOOP_FLUSH, handle, uv_hrtime() - start);
+    socketData->server->metrics.queuedBytes.subtract(flushed);
+    if (empty) {
+        uv_poll_start(handle, UV_READABLE, onReadable);
+    }
+}
+
+// sends queued messages until the socket would block (false) or nothing sendable is left (true), errors are left for the read side to find
+// flushed adds up the bytes that left the queue
+bool WebSocket::flushQueue(uv_poll_t *p, void *ssl, void *messageQueue, size_t *flushed)
+{
+    SocketData::Queue &queue = *(SocketData::Queue *) messageQueue;
     uv_os_sock_t fd;
-    uv_fileno((uv_handle_t *) handle, (uv_os_fd_t *) &fd);
+    uv_fileno((uv_handle_t *) p, (uv_os_fd_t *) &fd);
 
     do {
-        SocketData::Queue::Message *messagePtr = socketData->messageQueue.front();
+        SocketData::Queue::Message *messagePtr = queue.front();
+
+        // a frame still being deflated on the thread pool, its job resumes us
+        if (!messagePtr->data) {
+            return true;
+        }
 
         ssize_t sent;
-        if (socketData->ssl) {
-            sent = SSL_write(socketData->ssl, messagePtr->data, messagePtr->length);
+        if (ssl) {
+            sent = SSL_write((SSL *) ssl, messagePtr->data, messagePtr->length);
         } else {
             sent = ::send(fd, messagePtr->data, messagePtr->length, MSG_NOSIGNAL);
         }
 
         if (sent == (int) messagePtr->length) {
+            if (flushed) {
+                *flushed += sent;
+            }
 
             if (messagePtr->callback) {
-                messagePtr->callback(handle, messagePtr->callbackData, false);
+                messagePtr->callback(p, messagePtr->callbackData, false);
             }
 
-            socketData->messageQueue.pop();
+            queue.pop();
         } else {
             if (sent == SOCKET_ERROR) {
                 // check to see if any error occurred
-                if (socketData->ssl) {
-                    int error = SSL_get_error(socketData->ssl, sent);
+                if (ssl) {
+                    int error = SSL_get_error((SSL *) ssl, sent);
                     if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
-                        return;
+                        return false;
                     }
                 } else {
     #ifdef _WIN32
@@ -340,24 +514,24 @@ void WebSocket::onWritableReadable(uv_poll_t *handle, int status, int events)
     #else
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
     #endif
-                        return;
+                        return false;
                     }
                 }
 
                 // error sending!
-                uv_poll_start(handle, UV_READABLE, onReadable);
-                return;
+                return true;
             } else {
                 // update the Message
+                if (flushed) {
+                    *flushed += sent;
+                }
                 messagePtr->data += sent;
                 messagePtr->length -= sent;
-                return;
+                return false;
             }
         }
-    } while (!socketData->messageQueue.empty());
-
-    // only receive when we have fully sent everything
-    uv_poll_start(handle, UV_READABLE, onReadable);
+    } while (!queue.empty());
+    return true;
 }
 
 void WebSocket::initPoll(Server *server, uv_os_sock_t fd, void *ssl, void *perMessageDeflate)
@@ -369,8 +543,13 @@ void WebSocket::initPoll(Server *server, uv_os_sock_t fd, void *ssl, void *perMe
 
     socketData->ssl = (SSL *) ssl;
     if (socketData->ssl) {
-        SSL_set_fd(socketData->ssl, fd);
-        SSL_set_mode(socketData->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
+        // a new BIO would lose the kernel TLS state of the handshake
+        if (SSL_get_fd(socketData->ssl) != (int) fd) {
+            SSL_set_fd(socketData->ssl, fd);
+        }
+        SSL_set_mode(socketData->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        socketData->kernelSend = kernelSend(socketData->ssl);
+        socketData->kernelRecv = kernelRecv(socketData->ssl);
     }
 
     p->data = socketData;
@@ -434,6 +613,11 @@ void WebSocket::close(bool force, unsigned short code, char *data, size_t length
         // reuse prev as timer, mark no timer set
         socketData->prev = nullptr;
 
+        socketData->server->metrics.connections.subtract();
+        if (force) {
+            socketData->server->metrics.forcedClose(code);
+        }
+
         // call disconnection callback on first close (graceful or force)
         socketData->server->disconnectionCallback(p, code, data, length);
     } else if (!force) {
@@ -442,9 +626,22 @@ void WebSocket::close(bool force, unsigned short code, char *data, size_t length
     }
 
     if (force) {
+        if (socketData->records) {
+            for (auto &callback : socketData->records->callbacks) {
+                callback.first(p, callback.second, true);
+            }
+            delete socketData->records;
+            socketData->records = nullptr;
+        }
+        if (socketData->corked) {
+            std::vector<uv_poll_t *> &corked = socketData->server->es.corked;
+            corked.erase(std::find(corked.begin(), corked.end(), p));
+        }
+
         // delete all messages in queue
         while (!socketData->messageQueue.empty()) {
             SocketData::Queue::Message *message = socketData->messageQueue.front();
+            socketData->server->metrics.queuedBytes.subtract(message->length);
             if (message->callback) {
                 message->callback(nullptr, message->callbackData, true);
             }
@@ -457,7 +654,11 @@ void WebSocket::close(bool force, unsigned short code, char *data, size_t length
         });
 
         ::close(fd);
-        SSL_free(socketData->ssl);
+        if (socketData->ssl) {
+            // a dropped connection keeps its session resumable, OpenSSL would evict it otherwise
+            SSL_set_shutdown(socketData->ssl, SSL_SENT_SHUTDOWN);
+            SSL_free(socketData->ssl);
+        }
         socketData->controlBuffer.clear();
 
         // cancel force close timer
@@ -468,7 +669,14 @@ void WebSocket::close(bool force, unsigned short code, char *data, size_t length
             });
         }
 
-        delete socketData->pmd;
+        if (socketData->backlog) {
+            socketData->backlog->cancel();
+        }
+        if (socketData->pmd && socketData->pmd->jobs) {
+            socketData->pmd->orphaned = true;
+        } else {
+            delete socketData->pmd;
+        }
         delete socketData;
     } else {
         // force close after 15 seconds
@@ -480,12 +688,13 @@ void WebSocket::close(bool force, unsigned short code, char *data, size_t length
         }, 15000, 0);
 
         char *sendBuffer = socketData->server->sendBuffer;
+        socketData->server->metrics.sent(CLOSE, code ? std::min<size_t>(1024, length) + 2 : length);
         if (code) {
             length = std::min<size_t>(1024, length) + 2;
             *((uint16_t *) &sendBuffer[length + 2]) = htons(code);
             memcpy(&sendBuffer[length + 4], data, length - 2);
         }
-        write(sendBuffer, formatMessage(sendBuffer, &sendBuffer[length + 2], length, CLOSE, length, false), false, [](WebSocket webSocket, void *data, bool cancelled) {
+        write(sendBuffer, formatMessage(sendBuffer, &sendBuffer[length + 2], length, CLOSE, length, false, socketData->client ? SND_MASKED : 0), false, [](WebSocket webSocket, void *data, bool cancelled) {
             if (!cancelled) {
                 uv_os_sock_t fd;
                 uv_fileno((uv_handle_t *) webSocket.p, (uv_os_fd_t *) &fd);
@@ -502,17 +711,91 @@ void WebSocket::close(bool force, unsigned short code, char *data, size_t length
 // async Unix send (has a Message struct in the start if transferOwnership OR preparedMessage)
 void WebSocket::write(char *data, size_t length, bool transferOwnership, void(*callback)(WebSocket webSocket, void *data, bool cancelled), void *callbackData, bool preparedMessage)
 {
+    SocketData *socketData = (SocketData *) p->data;
+    bool onLoop = socketData->server->es.loopType == MASTER || pthread_self() == socketData->server->es.tid;
+
+    // small frames on TLS share records, they are sent when the loop iteration ends or a record fills up
+    if (socketData->ssl && !socketData->kernelSend && onLoop && length < SocketData::Records::RECORD_SIZE) {
+        if (socketData->records && socketData->records->data.length() + length > SocketData::Records::RECORD_SIZE) {
+            flushRecords();
+        }
+
+        if (socketData->messageQueue.empty()) {
+            if (!socketData->records) {
+                socketData->records = new SocketData::Records;
+            }
+            if (!socketData->corked) {
+                socketData->corked = true;
+                socketData->server->es.corked.push_back(p);
+            }
+
+            socketData->records->data.append(data, length);
+            if (callback) {
+                socketData->records->callbacks.push_back({callback, callbackData});
+            }
+            if (transferOwnership) {
+                delete [] (data - sizeof(SocketData::Queue::Message));
+            }
+            return;
+        }
+    } else if (socketData->records) {
+        flushRecords();
+    }
+
+    SocketData::Queue::Message *tail = socketData->messageQueue.tail;
+    bool wasEmpty = queueWrite(p, socketData->kernelSend ? nullptr : socketData->ssl, &socketData->messageQueue, data, length, transferOwnership, callback, callbackData, preparedMessage);
+    if (socketData->messageQueue.tail != tail) {
+        socketData->server->metrics.queuedBytes.add(socketData->messageQueue.tail->length);
+    }
+    if (wasEmpty) {
+        if (onLoop) {
+            uv_poll_start(p, UV_WRITABLE | UV_READABLE, onWritableReadable);
+        } else {
+            socketData->server->es.changePollAsync(p);
+        }
+    }
+}
+
+// everything buffered goes out as one SSL_write, the callbacks of the frames in it run once it left
+void WebSocket::flushRecords()
+{
+    SocketData *socketData = (SocketData *) p->data;
+    SocketData::Records *records = socketData->records;
+    if (!records) {
+        return;
+    }
+
+    socketData->records = nullptr;
+    SocketData::Queue::Message *tail = socketData->messageQueue.tail;
+    bool wasEmpty = queueWrite(p, socketData->ssl, &socketData->messageQueue, (char *) records->data.data(), records->data.length(), false, [](WebSocket webSocket, void *data, bool cancelled) {
+        SocketData::Records *records = (SocketData::Records *) data;
+        for (auto &callback : records->callbacks) {
+            callback.first(webSocket, callback.second, cancelled);
+        }
+        delete records;
+    }, records, false);
+    if (socketData->messageQueue.tail != tail) {
+        socketData->server->metrics.queuedBytes.add(socketData->messageQueue.tail->length);
+    }
+    if (wasEmpty) {
+        uv_poll_start(p, UV_WRITABLE | UV_READABLE, onWritableReadable);
+    }
+}
+
+// sends right away while nothing is queued and queues the rest, true if the queue was empty before and writable polling has to start
+bool WebSocket::queueWrite(uv_poll_t *p, void *ssl, void *messageQueue, char *data, size_t length, bool transferOwnership, void(*callback)(WebSocket webSocket, void *data, bool cancelled), void *callbackData, bool preparedMessage)
+{
+    SocketData::Queue &queue = *(SocketData::Queue *) messageQueue;
     uv_os_sock_t fd;
     uv_fileno((uv_handle_t *) p, (uv_os_fd_t *) &fd);
 
     ssize_t sent = 0;
-    SocketData *socketData = (SocketData *) p->data;
-    if (!socketData->messageQueue.empty()) {
+    if (!queue.empty()) {
         goto queueIt;
     }
 
-    if (socketData->ssl) {
-        sent = SSL_write(socketData->ssl, data, length);
+    if (ssl) {
+        sent = SSL_write((SSL *) ssl, data, length);
     } else {
         sent = ::send(fd, data, length, MSG_NOSIGNAL);
     }
@@ -531,8 +814,8 @@ void WebSocket::write(char *data, size_t length, bool transferOwnership, void(*c
         // not everything was sent
         if (sent == SOCKET_ERROR) {
             // check to see if any error occurred
-            if (socketData->ssl) {
-                int error = SSL_get_error(socketData->ssl, sent);
+            if (ssl) {
+                int error = SSL_get_error((SSL *) ssl, sent);
                 if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
                     goto queueIt;
                 }
@@ -555,7 +838,7 @@ void WebSocket::write(char *data, size_t length, bool transferOwnership, void(*c
                 callback(p, callbackData, true);
             }
 
-            return;
+            return false;
         } else {
 
             queueIt:
@@ -586,18 +869,12 @@ void WebSocket::write(char *data, size_t length, bool transferOwnership, void(*c
 
             messagePtr->callback = callback;
             messagePtr->callbackData = callbackData;
-            bool wasEmpty = socketData->messageQueue.empty();
-            socketData->messageQueue.push(messagePtr);
-
-            if (wasEmpty) {
-                if (socketData->server->es.loopType == MASTER || pthread_self() == socketData->server->es.tid) {
-                    uv_poll_start(p, UV_WRITABLE | UV_READABLE, onWritableReadable);
-                } else {
-                    socketData->server->es.changePollAsync(p);
-                }
-            }
+            bool wasEmpty = queue.empty();
+            queue.push(messagePtr);
+            return wasEmpty;
         }
     }
+    return false;
 }
 
 }
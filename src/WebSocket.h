@@ -22,6 +22,10 @@ class WIN32_EXPORT WebSocket
     friend class Server;
     friend class Parser;
     friend class EventSystem;
+    friend class HTTPSocket;
+    friend class ClientSocket;
+    friend struct Backlog;
+    friend struct DeflateJob;
     friend struct std::hash<uWS::WebSocket>;
 private:
     static void onReadable(uv_poll_t *p, int status, int events);
@@ -31,7 +35,13 @@ private:
     uv_poll_t *next();
     operator bool();
     void write(char *data, size_t length, bool transferOwnership, void(*callback)(WebSocket webSocket, void *data, bool cancelled) = nullptr, void *callbackData = nullptr, bool preparedMessage = false);
+    static bool queueWrite(uv_poll_t *p, void *ssl, void *messageQueue, char *data, size_t length, bool transferOwnership, void(*callback)(WebSocket webSocket, void *data, bool cancelled), void *callbackData, bool preparedMessage);
+    static bool flushQueue(uv_poll_t *p, void *ssl, void *messageQueue, size_t *flushed = nullptr);
+    void flushRecords();
+    void sendFrame(const char *message, size_t length, OpCode opCode, size_t reportedLength, int flags, void(*callback)(WebSocket webSocket, void *data, bool cancelled) = nullptr, void *callbackData = nullptr);
+    bool sendCompressed(const char *message, size_t length, OpCode opCode, int flags, void *stream, int level, void(*callback)(WebSocket webSocket, void *data, bool cancelled) = nullptr, void *callbackData = nullptr);
     void handleFragment(const char *fragment, size_t length, OpCode opCode, bool fin, size_t remainingBytes, bool compressed);
+    void consumeBuffered(const char *data, size_t length);
 protected:
     uv_poll_t *p;
     WebSocket(uv_poll_t *p);
@@ -50,6 +60,7 @@ public:
 
     Address getAddress();
     void close(bool force = false, unsigned short code = 0, char *data = nullptr, size_t length = 0);
+    // while an offloaded message still deflates with the socket's own stream later messages go out uncompressed, counted as skippedBusy
     void send(const char *message, size_t length, OpCode opCode, void(*callback)(WebSocket webSocket, void *data, bool cancelled) = nullptr, void *callbackData = nullptr, size_t fakedLength = 0);
     void ping(const char *message = nullptr, size_t length = 0);
     void sendFragment(char *data, size_t length, OpCode opCode, size_t remainingBytes);
@@ -61,6 +72,8 @@ public:
     WebSocket() : p(nullptr) {}
     bool operator==(const WebSocket &other) const {return p == other.p;}
     bool operator<(const WebSocket &other) const {return p < other.p;}
+private:
+    void writePrepared(PreparedMessage *preparedMessage);
 };
 
 }
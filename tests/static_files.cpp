@@ -0,0 +1,175 @@
+/* StaticFiles without any sockets, requests are parsed from text and files live in a fresh temporary directory */
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <StaticFiles.h>
+using namespace std;
+
+int failures = 0;
+
+#define CHECK(condition) \
+    if (!(condition)) { \
+        cout << __FILE__ << ":" << __LINE__ << ": " << #condition << endl; \
+        failures++; \
+    }
+
+string root;
+
+void writeFile(string name, string content)
+{
+    FILE *file = fopen((root + name).c_str(), "w");
+    fwrite(content.data(), 1, content.length(), file);
+    fclose(file);
+}
+
+// the request text has to outlive the returned view
+uWS::Asset *get(uWS::StaticFiles &staticFiles, string &head, string url, uint64_t now = 0)
+{
+    static uWS::Header headers[uWS::HTTPParser::MAX_HEADERS];
+    head = "GET " + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    uWS::HTTPRequest request;
+    uWS::HTTPParser::parse((char *) head.data(), head.length(), request, headers);
+    return staticFiles.matches(request) ? staticFiles.get(request, now) : nullptr;
+}
+
+void testPaths()
+{
+    uWS::StaticFiles staticFiles("/static", root);
+    string head;
+    writeFile("/index.html", "index");
+
+    // too short to end in /.. and not there either
+    CHECK(!get(staticFiles, head, "/static/a"));
+    CHECK(!get(staticFiles, head, "/static/ab"));
+    CHECK(!get(staticFiles, head, "/static/.."));
+    CHECK(!get(staticFiles, head, "/static/x/../index.html"));
+    CHECK(!get(staticFiles, head, "/staticindex.html"));
+
+    // an empty path and a lone slash are the directory itself
+    uWS::Asset *asset = get(staticFiles, head, "/static");
+    CHECK(asset && asset->size == 5);
+    CHECK(get(staticFiles, head, "/static/") == asset);
+    CHECK(get(staticFiles, head, "/static/?query") == asset);
+}
+
+void testMemory()
+{
+    uWS::StaticFiles staticFiles("/", root);
+    string head;
+    writeFile("/small.txt", "hello");
+    writeFile("/large.bin", string(uWS::StaticFiles::MEMORY_LIMIT + 1, 'x'));
+
+    // small files are one prebuilt response and keep no descriptor
+    uWS::Asset *small = get(staticFiles, head, "/small.txt");
+    CHECK(small && small->response && small->fd == -1);
+    string response(small->response, small->responseLength);
+    CHECK(response == small->headers + "hello");
+    CHECK(small->headers.find("Content-Length: 5\r\n") != string::npos);
+    CHECK(small->headers.find("Content-Type: text/plain; charset=utf-8\r\n") != string::npos);
+
+    // truncating the file underneath must not touch the copy
+    CHECK(!truncate((root + "/small.txt").c_str(), 0));
+    CHECK(string(small->response, small->responseLength) == response);
+
+    // larger ones are sent from their descriptor
+    uWS::Asset *large = get(staticFiles, head, "/large.bin");
+    CHECK(large && !large->response && large->fd != -1 && large->size == uWS::StaticFiles::MEMORY_LIMIT + 1);
+    CHECK(large->headers.find("Content-Type: application/octet-stream\r\n") != string::npos);
+}
+
+void testCache()
+{
+    uWS::StaticFiles staticFiles("/", root);
+    string head;
+    writeFile("/cached.txt", "first");
+
+    uWS::Asset *first = get(staticFiles, head, "/cached.txt", 1);
+    CHECK(first && string(first->response + first->headers.length(), first->size) == "first");
+
+    // within a second the file is not looked at again
+    writeFile("/cached.txt", "second!");
+    CHECK(get(staticFiles, head, "/cached.txt", uWS::StaticFiles::REVALIDATE) == first);
+
+    // a response still sending the old asset keeps it alive after it was replaced
+    first->references++;
+    uWS::Asset *second = get(staticFiles, head, "/cached.txt", 1 + uWS::StaticFiles::REVALIDATE);
+    CHECK(second && second != first && string(second->response + second->headers.length(), second->size) == "second!");
+    CHECK(second->etag != first->etag);
+    CHECK(string(first->response + first->headers.length(), first->size) == "first");
+    first->release();
+
+    // unchanged files are revalidated in place
+    CHECK(get(staticFiles, head, "/cached.txt", 2 + 2 * uWS::StaticFiles::REVALIDATE) == second);
+
+    // and removed ones are gone
+    unlink((root + "/cached.txt").c_str());
+    CHECK(!get(staticFiles, head, "/cached.txt", 3 + 3 * uWS::StaticFiles::REVALIDATE));
+}
+
+void testGzip()
+{
+    uWS::StaticFiles staticFiles("/", root);
+    string head;
+    writeFile("/app.js", "plain");
+    writeFile("/app.js.gz", "zipped");
+    writeFile("/other.js", "plain");
+
+    uWS::Asset *asset = get(staticFiles, head, "/app.js");
+    CHECK(asset && asset->gzip && asset->gzip->size == 6);
+    CHECK(asset->headers.find("Vary: Accept-Encoding\r\n") != string::npos);
+    CHECK(asset->gzip->headers.find("Content-Encoding: gzip\r\n") != string::npos);
+    CHECK(asset->gzip->headers.find("Content-Type: application/javascript\r\n") != string::npos);
+
+    uWS::Asset *other = get(staticFiles, head, "/other.js");
+    CHECK(other && !other->gzip && other->headers.find("Vary") == string::npos);
+}
+
+bool acceptsGzip(const char *value)
+{
+    return uWS::StaticFiles::acceptsGzip(value, strlen(value));
+}
+
+void testAcceptEncoding()
+{
+    CHECK(acceptsGzip("gzip"));
+    CHECK(acceptsGzip("deflate, gzip, br"));
+    CHECK(acceptsGzip("GZip;q=0.5"));
+    CHECK(acceptsGzip("gzip ; q=1.0"));
+    CHECK(acceptsGzip("*"));
+    CHECK(acceptsGzip("br, *;q=0.1"));
+    CHECK(!acceptsGzip(""));
+    CHECK(!acceptsGzip("br, deflate"));
+    CHECK(!acceptsGzip("gzip;q=0"));
+    CHECK(!acceptsGzip("gzip;q=0.000, br"));
+    CHECK(!acceptsGzip("x-gzipped"));
+    CHECK(!acceptsGzip("*;q=0"));
+    CHECK(!acceptsGzip("gzip;q=0, *"));
+    CHECK(acceptsGzip("*;q=0, gzip"));
+}
+
+int main()
+{
+    char directory[] = "/tmp/uws_static_XXXXXX";
+    if (!mkdtemp(directory)) {
+        cout << "Could not create a temporary directory" << endl;
+        return -1;
+    }
+    root = directory;
+
+    testPaths();
+    testMemory();
+    testCache();
+    testGzip();
+    testAcceptEncoding();
+
+    system(("rm -rf " + root).c_str());
+    if (failures) {
+        cout << failures << " checks failed" << endl;
+        return -1;
+    }
+    cout << "All checks passed" << endl;
+    return 0;
+}
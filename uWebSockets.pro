@@ -10,19 +10,29 @@ SOURCES += main.cpp \
     src/WebSocket.cpp \
     src/Extensions.cpp \
     src/UTF8.cpp \
-    src/EventSystem.cpp
+    src/EventSystem.cpp \
+    src/Offload.cpp \
+    src/StaticFiles.cpp \
+    src/Metrics.cpp \
+    src/ClientSocket.cpp
 
 HEADERS += \
     src/Server.h \
     src/Network.h \
     src/HTTPSocket.h \
+    src/HTTPParser.h \
+    src/HTTPResponse.h \
     src/WebSocket.h \
     src/Extensions.h \
     src/uWS.h \
     src/Parser.h \
     src/SocketData.h \
     src/UTF8.h \
-    src/EventSystem.h
+    src/EventSystem.h \
+    src/Offload.h \
+    src/StaticFiles.h \
+    src/Metrics.h \
+    src/ClientSocket.h
 
 LIBS += -lssl -lcrypto -lz -luv -lpthread
 